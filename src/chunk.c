@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk *chunk) {
@@ -11,6 +12,11 @@ void initChunk(Chunk *chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
+  chunk->constantLookupCapacity = 0;
+  chunk->constantLookup = NULL;
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
@@ -30,6 +36,12 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
 void writeConstant(Chunk *chunk, Value value, int line) {
   int index = addConst(chunk, value);
 
+  if (index <= UINT8_MAX) {
+    writeChunk(chunk, OP_CONSTANT_SHORT, line);
+    writeChunk(chunk, index, line);
+    return;
+  }
+
   writeChunk(chunk, OP_CONSTANT, line);
   writeChunk(chunk, (index >> 8) & 0xff, line);
   writeChunk(chunk, index & 0xff, line);
@@ -39,12 +51,211 @@ void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+  freeConstantLookup(chunk);
   initChunk(chunk);
 }
 
+// constants are the same only when they are identical, so 0 and -0 don't
+// share a slot (and NaN still finds itself)
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case VAL_BOOL:
+      return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NUM:
+      return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    case VAL_OBJ:
+      return AS_OBJ(a) == AS_OBJ(b);
+    default:
+      return true;
+  }
+#endif
+}
+
+static uint32_t hashConstant(Value value) {
+  uint64_t bits;
+#ifdef NAN_BOXING
+  bits = value;
+#else
+  switch (value.type) {
+    case VAL_BOOL:
+      bits = AS_BOOL(value);
+      break;
+    case VAL_NUM:
+      memcpy(&bits, &value.as.number, sizeof(double));
+      break;
+    case VAL_OBJ:
+      bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+      break;
+    default:
+      bits = value.type;
+      break;
+  }
+#endif
+  // mix bits so pointers and small integers spread over the table
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static int *findConstantSlot(int *lookup, int capacity, ValueArray *constants,
+                             Value value) {
+  uint32_t index = hashConstant(value) & (capacity - 1);
+  for (;;) {
+    int *slot = &lookup[index];
+    if (*slot == 0 || sameConstant(constants->values[*slot - 1], value)) {
+      return slot;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+// rebuilds lookup from all constants (also after freeConstantLookup)
+static void growConstantLookup(Chunk *chunk) {
+  int capacity = GROW_CAPACITY(chunk->constantLookupCapacity);
+  while (capacity < (chunk->constants.count + 1) * 2) capacity *= 2;
+
+  int *lookup = ALLOCATE(int, capacity);
+  for (int i = 0; i < capacity; i++) lookup[i] = 0;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    *findConstantSlot(lookup, capacity, &chunk->constants,
+                      chunk->constants.values[i]) = i + 1;
+  }
+
+  freeConstantLookup(chunk);
+  chunk->constantLookup = lookup;
+  chunk->constantLookupCapacity = capacity;
+}
+
 int addConst(Chunk *chunk, Value value) {
+  // keep table at most half full
+  if ((chunk->constants.count + 1) * 2 > chunk->constantLookupCapacity) {
+    push(value);
+    growConstantLookup(chunk);
+    pop();
+  }
+
+  int *slot = findConstantSlot(chunk->constantLookup,
+                               chunk->constantLookupCapacity,
+                               &chunk->constants, value);
+  if (*slot != 0) return *slot - 1;
+
   push(value);
   writeValueArray(&chunk->constants, value);
   pop();
+  *slot = chunk->constants.count;
   return chunk->constants.count - 1;
 }
+
+void freeConstantLookup(Chunk *chunk) {
+  FREE_ARRAY(int, chunk->constantLookup, chunk->constantLookupCapacity);
+  chunk->constantLookup = NULL;
+  chunk->constantLookupCapacity = 0;
+}
+
+int addInlineCache(Chunk *chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity);
+  }
+
+  InlineCache *cache = &chunk->caches[chunk->cacheCount];
+  cache->state = IC_UNINITIALIZED;
+  cache->count = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  return chunk->cacheCount++;
+}
+
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_NEGATE:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_POWER:
+    case OP_RETURN:
+    case OP_POP:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+      return 1;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CONSTANT_SHORT:
+    case OP_GET_GLOBAL_SHORT:
+    case OP_SET_GLOBAL_SHORT:
+    case OP_GET_LOCAL_SHORT:
+    case OP_SET_LOCAL_SHORT:
+    case OP_GET_UPVALUE_SHORT:
+    case OP_SET_UPVALUE_SHORT:
+    case OP_GET_CAPTURED_SHORT:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      return 3;
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+    case OP_LOOP_LT:
+      return 5;
+    case OP_FOR_NUM_STEP:
+      return 7;
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_GET_SUPER:
+    case OP_JUMP_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_CLASS:
+    case OP_METHOD:
+      return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      return 5;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return 6;
+    case OP_CLOSURE: {
+      uint16_t constant =
+          (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+      ObjFunc *function = AS_FUNCTION(chunk->constants.values[constant]);
+      // every upvalue is isLocal byte and 2 bytes of index
+      return 3 + function->upvalueCount * 3;
+    }
+  }
+
+  return 1;  // unreachable
+}
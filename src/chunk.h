@@ -9,23 +9,56 @@
 // OP_CONSTANT, OP_DEFINE_GLOBAL, OP_GET_GLOBAL, OP_SET_GLOBAL,
 // OP_SET_LOCAL, OP_GET_LOCAL, OP_CLOSURE, OP_GET_UPVALUE, OP_SET_UPVALUE,
 // OP_CLASS, OP_GET_PROPERTY, OP_SET_PROPERTY, OP_METHOD, OP_GET_SUPER
-// all uses 2 bytes for the constant index it wastes some memory but
-// it's not a big deal (can be optimized later if needed)
+// use 2 bytes for the index. OP_CONSTANT, OP_GET_LOCAL, OP_SET_LOCAL,
+// OP_GET_UPVALUE, OP_SET_UPVALUE, OP_GET_GLOBAL and OP_SET_GLOBAL also have
+// *_SHORT forms with 1 byte index that compiler uses for indexes < 256
+//
+// constants are deduplicated per chunk (see addConst), so one name used
+// many times in a function takes one slot
+//
+// global ops use index of the global slot (vm.globalValues) instead of
+// a constant
+//
+// OP_NOT_EQUAL, OP_GREATER_EQUAL, OP_LESS_EQUAL and OP_POP_JUMP_IF_FALSE
+// are only created by the peephole optimizer (optimizer.c)
+//
+// OP_GET_PROPERTY and OP_SET_PROPERTY have one more 2 byte operand after
+// the name: index of their inline cache in chunk's caches array,
+// OP_INVOKE and OP_SUPER_INVOKE have it after the argument count
+//
+// OP_CLOSURE is followed by capture byte (CaptureKind) and 2 byte index
+// for every upvalue. locals that are never assigned are copied into the
+// closure (CAPTURE_VALUE) and read by OP_GET_CAPTURED instead of
+// OP_GET_UPVALUE, compiler patches both when the local's scope ends
+//
+// OP_LOOP_LT (counter slot, limit slot, jump) and OP_FOR_NUM_STEP
+// (counter slot, limit slot, 2 byte step constant, jump back) are emitted
+// for `for (var i = ...; i < n; i = i + step)` loops (see forStatement).
+// like for every jump, the jump offset is the last 2 bytes of instruction
 // -----------------------------------------------------------------------------
 
 typedef enum {
-  OP_CONSTANT,  // push a constant to the stack
-
-  OP_DEFINE_GLOBAL,  // define a global variable
-  OP_GET_GLOBAL,     // get global variable
-  OP_SET_GLOBAL,     // set global variable
-
-  OP_SET_LOCAL,  // set local variable
-  OP_GET_LOCAL,  // get local variable
-
-  OP_GET_UPVALUE,    // get upvalue
-  OP_SET_UPVALUE,    // set upvalue
-  OP_CLOSE_UPVALUE,  // close upvalue (isn't on stack anymore)
+  OP_CONSTANT,        // push a constant to the stack
+  OP_CONSTANT_SHORT,  // push a constant (1 byte index)
+
+  OP_DEFINE_GLOBAL,     // define a global variable
+  OP_GET_GLOBAL,        // get global variable
+  OP_SET_GLOBAL,        // set global variable
+  OP_GET_GLOBAL_SHORT,  // get global variable (1 byte index)
+  OP_SET_GLOBAL_SHORT,  // set global variable (1 byte index)
+
+  OP_SET_LOCAL,        // set local variable
+  OP_GET_LOCAL,        // get local variable
+  OP_SET_LOCAL_SHORT,  // set local variable (1 byte index)
+  OP_GET_LOCAL_SHORT,  // get local variable (1 byte index)
+
+  OP_GET_UPVALUE,         // get upvalue
+  OP_SET_UPVALUE,         // set upvalue
+  OP_GET_UPVALUE_SHORT,   // get upvalue (1 byte index)
+  OP_SET_UPVALUE_SHORT,   // set upvalue (1 byte index)
+  OP_GET_CAPTURED,        // get upvalue captured by value
+  OP_GET_CAPTURED_SHORT,  // get upvalue captured by value (1 byte index)
+  OP_CLOSE_UPVALUE,       // close upvalue (isn't on stack anymore)
 
   OP_GET_PROPERTY,  // get value of property
   OP_SET_PROPERTY,  // set value of property
@@ -36,10 +69,13 @@ typedef enum {
   OP_TRUE,   // true
   OP_FALSE,  // false
 
-  OP_NOT,      // not
-  OP_EQUAL,    // equal
-  OP_GREATER,  // greater
-  OP_LESS,     // less
+  OP_NOT,            // not
+  OP_EQUAL,          // equal
+  OP_GREATER,        // greater
+  OP_LESS,           // less
+  OP_NOT_EQUAL,      // not equal (EQUAL NOT)
+  OP_GREATER_EQUAL,  // greater or equal (LESS NOT)
+  OP_LESS_EQUAL,     // less or equal (GREATER NOT)
 
   OP_NEGATE,    // negate
   OP_ADD,       // add
@@ -51,12 +87,16 @@ typedef enum {
   OP_RETURN,  // return the top of the stack
   OP_POP,     // pop the top of the stack
 
-  OP_JUMP_FALSE,  // jump to a specific offset when false
-  OP_JUMP,        // jump to a specific offset
-  OP_LOOP,        // works like jump but with negative offset
+  OP_JUMP_FALSE,          // jump to a specific offset when false
+  OP_POP_JUMP_IF_FALSE,   // pop condition, jump when it was false
+  OP_JUMP,                // jump to a specific offset
+  OP_LOOP,                // works like jump but with negative offset
+  OP_LOOP_LT,             // counted loop entry, jump past it when !(i < n)
+  OP_FOR_NUM_STEP,        // counted loop end, i += step, loop when i < n
 
-  OP_CALL,     // call a function
-  OP_CLOSURE,  // create a closure
+  OP_CALL,       // call a function
+  OP_TAIL_CALL,  // call that replaces the current frame (`return f()`)
+  OP_CLOSURE,    // create a closure
 
   OP_INVOKE,        // invoke method
   OP_SUPER_INVOKE,  // invoke method of super
@@ -64,14 +104,83 @@ typedef enum {
   OP_CLASS,    // create a class
   OP_METHOD,   // define method of a class
   OP_INHERIT,  // inherit class from another
+
+  // quickened ops, compiler never emits them. vm rewrites generic op into
+  // one of these after seeing its operand types and rewrites it back when
+  // the types don't match anymore
+  OP_ADD_NUM,       // add two numbers
+  OP_ADD_STR,       // concatenate two strings
+  OP_SUBTRACT_NUM,  // subtract two numbers
+  OP_MULTIPLY_NUM,  // multiply two numbers
+  OP_DIVIDE_NUM,    // divide two numbers
+  OP_GREATER_NUM,   // compare two numbers
+  OP_LESS_NUM,      // compare two numbers
+
+  // superinstructions, only the optimizer emits them (see optimizer.h).
+  // operands are operands of the fused instructions, in order
+  OP_ADD_LOCALS,                // GET_LOCAL_SHORT GET_LOCAL_SHORT ADD
+  OP_ADD_LOCAL_CONSTANT,        // GET_LOCAL_SHORT CONSTANT_SHORT ADD
+  OP_SUBTRACT_LOCAL_CONSTANT,   // GET_LOCAL_SHORT CONSTANT_SHORT SUBTRACT
+  OP_SET_LOCAL_POP,             // SET_LOCAL_SHORT POP
+  OP_LESS_LOCAL_CONSTANT_JUMP,  // GET_LOCAL_SHORT CONSTANT_SHORT LESS
+                                // POP_JUMP_IF_FALSE
 } OpCode;
 
+// how OP_CLOSURE gets an upvalue
+typedef enum {
+  CAPTURE_UPVALUE,  // upvalue of the enclosing closure
+  CAPTURE_LOCAL,    // local of enclosing function, boxed in ObjUpvalue
+  CAPTURE_VALUE,    // value of local of enclosing function
+} CaptureKind;
+
+// Inline caches remember what property lookups at one instruction resolved
+// to, keyed by shape of the receiver (shapes belong to one class, so shape
+// also implies the class). OP_SUPER_INVOKE is keyed by the superclass
+// instead. Cache only moves forward:
+// uninitialized -> monomorphic (1 entry) -> polymorphic (up to
+// IC_POLYMORPHIC_MAX entries) -> megamorphic (gives up, always slow path)
+typedef enum {
+  IC_UNINITIALIZED,
+  IC_MONOMORPHIC,
+  IC_POLYMORPHIC,
+  IC_MEGAMORPHIC,
+} InlineCacheState;
+
+#define IC_POLYMORPHIC_MAX 4
+
+typedef struct {
+  struct Obj *key;              // receiver shape (superclass for super)
+  struct ObjShape *transition;  // set: shape after adding field (or NULL)
+  struct ObjClosure *method;    // get: method to bind when field is absent
+  uint32_t version;             // class methods version the method is from
+  int slot;                     // field slot
+} InlineCacheEntry;
+
+typedef struct {
+  InlineCacheState state;
+  int count;
+  InlineCacheEntry entries[IC_POLYMORPHIC_MAX];
+
+  // counters (see DEBUG_INLINE_CACHES)
+  uint32_t hits;
+  uint32_t misses;
+} InlineCache;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
   int *lines;
   ValueArray constants;
+
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache *caches;
+
+  // hash set of constant indexes (index + 1, 0 is empty) keyed by bits of
+  // the value, only needed while compiling (see freeConstantLookup)
+  int constantLookupCapacity;
+  int *constantLookup;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -79,6 +188,13 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line);
 void writeConstant(Chunk *chunk, Value value, int line);
 void freeChunk(Chunk *chunk);
 
+// returns index of value in chunk constants, adds it only when chunk
+// doesn't have the same value yet (numbers are compared by bits)
 int addConst(Chunk *chunk, Value value);
+void freeConstantLookup(Chunk *chunk);
+int addInlineCache(Chunk *chunk);
+
+// size in bytes of instruction at offset (opcode and operands)
+int instructionLength(Chunk *chunk, int offset);
 
 #endif
@@ -8,13 +8,31 @@
 #define INIT_STRING "init"  // string for init method of class
 #define INIT_STRING_LEN 4   // len of init string
 
+// defaults of pacer settings (see --gc-growth and --gc-min-heap)
 #define GC_HEAP_GROW_FACTOR 2    // grow factor for GC
 #define GC_BEFORE_FIRST 1048576  // 1024 * 1024 before first GC call
+#define GC_NURSERY_SIZE 262144   // bytes allocated between minor GCs
+#define GC_STEP_SIZE 65536       // bytes allocated between incremental steps
+#define GC_MAX_PAUSE 1000        // default step budget in microseconds
+
+// Dispatch of run() loop: computed goto (labels as values) when compiler
+// supports it, plain switch otherwise (or when NO_COMPUTED_GOTO is defined)
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Pack values into 64 bits (doubles with nil, bools and objects hidden in
+// quiet NaNs), define NO_NAN_BOXING to get the tagged union representation
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
 
 // Uncomment to get debug info
 // #define DEBUG_LOG_GC           // logs about GC
 // #define DEBUG_STRESS_GC        // run GC as often as it possibly can
 // #define DEBUG_PRINT_CODE       // print code after compilation
 // #define DEBUG_TRACE_EXECUTION  // print every vm state while running
+// #define DEBUG_INLINE_CACHES    // print inline cache hit rates at exit
+// #define DEBUG_PROFILE_OPCODES  // print most frequent opcode pairs/triples
 
 #endif
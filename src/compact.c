@@ -0,0 +1,173 @@
+#include "compact.h"
+
+#include <stdio.h>
+
+#include "compiler.h"
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+static Value forwardValue(Value value) {
+  if (!IS_OBJ(value)) return value;
+  return OBJ_VAL(forwardObject(AS_OBJ(value)));
+}
+
+#define FORWARD(type, pointer) \
+  ((pointer) = (type *)forwardObject((Obj *)(pointer)))
+
+static void updateArray(ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    array->values[i] = forwardValue(array->values[i]);
+  }
+}
+
+static void updateTable(Table *table) {
+  for (int i = 0; i <= table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    FORWARD(ObjString, entry->key);
+    entry->value = forwardValue(entry->value);
+  }
+}
+
+static void updateInlineCaches(Chunk *chunk) {
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    InlineCache *cache = &chunk->caches[i];
+    for (int j = 0; j < cache->count; j++) {
+      FORWARD(Obj, cache->entries[j].key);
+      FORWARD(ObjShape, cache->entries[j].transition);
+      FORWARD(ObjClosure, cache->entries[j].method);
+    }
+  }
+}
+
+static void moved(Obj *from, Obj *to) {
+  // closed upvalue points to its own field
+  if (to->type == OBJ_UPVALUE) {
+    ObjUpvalue *upvalue = (ObjUpvalue *)to;
+    if (upvalue->location == &((ObjUpvalue *)from)->closed) {
+      upvalue->location = &upvalue->closed;
+    }
+  }
+}
+
+static void updateObject(Obj *obj) {
+  switch (obj->type) {
+    case OBJ_STRING: {
+      ObjString *string = (ObjString *)obj;
+      // short chars are heap cells (see ALLOCATE_CELL)
+      if (string->length + 1 <= CELL_MAX_SIZE) {
+        string->chars = evacuateCell(string->chars);
+      }
+      break;
+    }
+    case OBJ_NATIVE:
+      break;
+    case OBJ_UPVALUE: {
+      ObjUpvalue *upvalue = (ObjUpvalue *)obj;
+      upvalue->closed = forwardValue(upvalue->closed);
+      FORWARD(ObjUpvalue, upvalue->next);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunc *func = (ObjFunc *)obj;
+      FORWARD(ObjString, func->name);
+      updateArray(&func->chunk.constants);
+      updateInlineCaches(&func->chunk);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = (ObjClosure *)obj;
+      FORWARD(ObjFunc, closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        closure->upvalues[i] = forwardValue(closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass *cclass = (ObjClass *)obj;
+      FORWARD(ObjString, cclass->name);
+      updateTable(&cclass->methods);
+      FORWARD(ObjShape, cclass->rootShape);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance *)obj;
+      FORWARD(ObjClass, instance->cclass);
+      if (instance->shape != NULL) {
+        FORWARD(ObjShape, instance->shape);
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+          instance->fields[i] = forwardValue(instance->fields[i]);
+        }
+      } else {
+        updateTable(instance->dictionary);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape *)obj;
+      FORWARD(ObjShape, shape->parent);
+      FORWARD(ObjString, shape->name);
+      updateTable(&shape->slots);
+      updateTable(&shape->transitions);
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+      bound->receiver = forwardValue(bound->receiver);
+      FORWARD(ObjClosure, bound->method);
+      break;
+    }
+  }
+}
+
+// everything markRoots marks, and weak vm.strings
+static void updateRoots() {
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    *slot = forwardValue(*slot);
+  }
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    FORWARD(ObjClosure, vm.frames[i].closure);
+  }
+
+  FORWARD(ObjUpvalue, vm.openUpvalues);
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    vm.openUpvalueSlots[upvalue->location - vm.stack] = upvalue;
+  }
+
+  updateTable(&vm.globalSlots);
+  updateArray(&vm.globalValues);
+  updateArray(&vm.globalNames);
+  updateTable(&vm.strings);
+
+  updateCompilerRoots();
+
+  FORWARD(ObjString, vm.initString);
+
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    FORWARD(Obj, vm.remembered[i]);
+  }
+}
+
+void compactHeap() {
+  collectGarbage();
+  vm.compactPending = false;
+
+  int evacuated = selectEvacuation();
+  if (evacuated == 0) return;
+
+  evacuateObjects(moved);
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    forEachObject((ObjType)type, updateObject);
+  }
+  updateRoots();
+  int released = releaseEvacuated();
+
+#ifdef DEBUG_LOG_GC
+  printf(" -- compaction released %d of %d segments\n", released, evacuated);
+  printHeapStats();
+#else
+  (void)released;
+#endif /* ifdef DEBUG_LOG_GC */
+}
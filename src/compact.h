@@ -0,0 +1,18 @@
+#ifndef iii_compact_h
+#define iii_compact_h
+
+#include "common.h"
+
+// Compaction runs full collection and then moves objects out of sparse heap
+// segments (see heap.h) so those segments can go back to the system. Every
+// reference to moved object is updated: values on the stack, call frames,
+// upvalues, tables, vm.strings, inline caches and compiler roots.
+//
+// C code keeps raw object pointers in its locals over allocation, so
+// objects can't move in collection started by allocation. Collection only
+// sets vm.compactPending (when vm.gcCompact is on and heap is fragmented)
+// and run() compacts on backward jumps, gcCompact() native compacts right
+// away (natives are called with nothing cached).
+void compactHeap();
+
+#endif
@@ -1,5 +1,6 @@
 #include "compiler.h"
 
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,7 +12,9 @@
 #include "compiler_arrays.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "vm.h"
 
 typedef struct {
   Token current;
@@ -41,6 +44,12 @@ typedef struct Compiler {
   UpvaluesArray upvalues;
 
   int scopeDepth;
+
+  // what is known about code at the end of chunk (for constant folding)
+  int lastConstant;  // offset of last OP_CONSTANT
+  int lastNumber;    // end of last op that always leaves a number
+  int lastTarget;    // offset where last forward jump lands
+  int lastCall;      // offset of last OP_CALL (for tail calls)
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -64,15 +73,20 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   initUpvaluesArray(&compiler->upvalues);
 
   compiler->scopeDepth = 0;
+  compiler->lastConstant = -1;
+  compiler->lastNumber = -1;
+  compiler->lastTarget = -1;
+  compiler->lastCall = -1;
   compiler->function = newFunction();
   current = compiler;
 
   if (type != TYPE_SCRIPT) {
     current->function->name =
         copyString(parser.previous.start, parser.previous.length);
+    writeBarrierObj((Obj *)current->function, (Obj *)current->function->name);
   }
 
-  Local local;
+  Local local = {0};
   local.depth = 0;
   local.isCaptured = false;
 
@@ -143,11 +157,44 @@ static void emitShort(uint16_t val) {
   emitBytes((val >> 8) & 0xff, val & 0xff);
 }
 
+// emits op with index operand, using 1 byte form when index fits
+static void emitIndexed(uint8_t op, uint16_t index) {
+  if (index > UINT8_MAX) {
+    emitByte(op);
+    emitShort(index);
+    return;
+  }
+
+  switch (op) {
+    case OP_GET_LOCAL:
+      emitBytes(OP_GET_LOCAL_SHORT, index);
+      break;
+    case OP_SET_LOCAL:
+      emitBytes(OP_SET_LOCAL_SHORT, index);
+      break;
+    case OP_GET_UPVALUE:
+      emitBytes(OP_GET_UPVALUE_SHORT, index);
+      break;
+    case OP_SET_UPVALUE:
+      emitBytes(OP_SET_UPVALUE_SHORT, index);
+      break;
+    case OP_GET_GLOBAL:
+      emitBytes(OP_GET_GLOBAL_SHORT, index);
+      break;
+    case OP_SET_GLOBAL:
+      emitBytes(OP_SET_GLOBAL_SHORT, index);
+      break;
+    default:
+      emitByte(op);
+      emitShort(index);
+      break;
+  }
+}
+
 static void emitReturn() {
   // if we are in initializer return this for user
   if (current->type == TYPE_INITIALIZER) {
-    emitByte(OP_GET_LOCAL);
-    emitShort(0);
+    emitIndexed(OP_GET_LOCAL, 0);
   } else {
     emitByte(OP_NIL);
   }
@@ -169,13 +216,51 @@ static void emitLoop(int loopStart) {
   emitShort((uint16_t)offset);
 }
 
+// local that is never assigned gets copied into closures: reads of every
+// function that captured it become OP_GET_CAPTURED and OP_CLOSUREs of the
+// current one copy it (its chunk isn't optimized yet, offsets are valid)
+static void captureByValue(Local *local) {
+  for (int i = 0; i < local->captures.count; i++) {
+    Capture *capture = &local->captures.values[i];
+    if (capture->function == NULL) {
+      currentChunk()->code[capture->index] = CAPTURE_VALUE;
+      continue;
+    }
+
+    Chunk *chunk = &capture->function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+      uint8_t *code = &chunk->code[offset];
+      if (code[0] == OP_GET_UPVALUE_SHORT && code[1] == capture->index) {
+        code[0] = OP_GET_CAPTURED_SHORT;
+      } else if (code[0] == OP_GET_UPVALUE &&
+                 ((code[1] << 8) | code[2]) == capture->index) {
+        code[0] = OP_GET_CAPTURED;
+      }
+    }
+  }
+}
+
 // ! endCompiler would not free upvalues array
 static ObjFunc *endCompiler() {
   emitReturn();
 
+  // locals of the function scope end here (return closes the boxed ones)
+  for (int i = 0; i < current->locals.count; i++) {
+    Local *local = &current->locals.values[i];
+    if (local->isCaptured && !local->isAssigned) captureByValue(local);
+    freeCapturesArray(&local->captures);
+  }
+
   current->function->upvalueCount = current->upvalues.count;
   ObjFunc *func = current->function;
 
+  if (!parser.hadError) {
+    optimizeChunk(currentChunk());
+    func->maxStack = maxStackDepth(currentChunk(), func->arity + 1);
+  }
+  freeConstantLookup(currentChunk());
+
 #ifdef DEBUG_PRINT_CODE
 
 #include "debug.h"
@@ -202,13 +287,18 @@ static void endScope() {
 
   while (count > 0 &&
          current->locals.values[count - 1].depth > current->scopeDepth) {
-    if (current->locals.values[count - 1].isCaptured) {
+    Local *local = &current->locals.values[count - 1];
+    if (local->isCaptured && local->isAssigned) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
+      if (local->isCaptured) captureByValue(local);
       emitByte(OP_POP);
     }
+    freeCapturesArray(&local->captures);
     count--;
   }
+
+  current->locals.count = count;
 }
 
 static bool check(TokenType type) { return parser.current.type == type; }
@@ -242,13 +332,37 @@ static void parsePrecedence(Precedence precedence) {
 }
 
 static uint16_t makeConstant(Value val) {
-  return (uint16_t)addConst(currentChunk(), val);
+  int constant = addConst(currentChunk(), val);
+  // function can get old while it is compiled
+  writeBarrier((Obj *)current->function, val);
+  if (constant > UINT16_MAX) {
+    error("Too many constants in one function");
+    return 0;
+  }
+  return (uint16_t)constant;
+}
+
+static uint16_t makeInlineCache() {
+  int cache = addInlineCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function");
+  }
+  return (uint16_t)cache;
 }
 
 static uint16_t identifierConstant(Token *name) {
   return (int)makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static uint16_t globalIndex(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token *a, Token *b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
@@ -268,6 +382,15 @@ static int resolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
+// local the upvalue of compiler refers to (through enclosing upvalues)
+static Local *capturedLocal(Compiler *compiler, int index) {
+  Upvalue *upvalue = &compiler->upvalues.values[index];
+  if (upvalue->isLocal) {
+    return &compiler->enclosing->locals.values[upvalue->index];
+  }
+  return capturedLocal(compiler->enclosing, upvalue->index);
+}
+
 static int addUpvalue(Compiler *compiler, uint16_t index, bool isLocal) {
   uint16_t upvalueCount = compiler->upvalues.count;
 
@@ -278,11 +401,20 @@ static int addUpvalue(Compiler *compiler, uint16_t index, bool isLocal) {
     }
   }
 
+  if (upvalueCount == UPVALUES_MAX) {
+    error("Too many closure variables in function");
+    return 0;
+  }
+
   Upvalue val;
   val.isLocal = isLocal;
   val.index = index;
   writeUpvaluesArray(&compiler->upvalues, val);
-  return compiler->upvalues.count - 1;  // count is index for next element
+  int upvalue = compiler->upvalues.count - 1;  // count is index for next
+
+  Capture capture = {compiler->function, upvalue};
+  writeCapturesArray(&capturedLocal(compiler, upvalue)->captures, capture);
+  return upvalue;
 }
 
 static int resolveUpvalue(Compiler *compiler, Token *name) {
@@ -309,6 +441,8 @@ static void addLocal(Token name) {
   local.depth = -1;
   local.name = name;
   local.isCaptured = false;
+  local.isAssigned = false;
+  initCapturesArray(&local.captures);
   writeLocalsArray(&current->locals, local);
 }
 
@@ -380,7 +514,7 @@ static uint16_t parseVar(const char *errorMessage) {
   declareVar();
   if (current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return globalIndex(&parser.previous);
 }
 
 static void namedVar(Token name, bool canAssign) {
@@ -398,19 +532,22 @@ static void namedVar(Token name, bool canAssign) {
     setOp = OP_SET_UPVALUE;
     argUint = (uint16_t)arg;
   } else {  // global var
-    argUint = identifierConstant(&name);
+    argUint = globalIndex(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
   if (canAssign && match(TOKEN_EQUAL))  // x = ...
   {
+    if (setOp == OP_SET_LOCAL) {
+      current->locals.values[arg].isAssigned = true;
+    } else if (setOp == OP_SET_UPVALUE) {
+      capturedLocal(current, arg)->isAssigned = true;
+    }
     expression();
-    emitByte(setOp);
-    emitShort(argUint);
+    emitIndexed(setOp, argUint);
   } else {
-    emitByte(getOp);
-    emitShort(argUint);
+    emitIndexed(getOp, argUint);
   }
 }
 
@@ -451,8 +588,15 @@ static void function(FunctionType type) {
 
   uint16_t count = func->upvalueCount;
   for (int i = 0; i < count; i++) {
-    emitByte(compiler.upvalues.values[i].isLocal ? 1 : 0);
-    emitShort(compiler.upvalues.values[i].index);
+    Upvalue *upvalue = &compiler.upvalues.values[i];
+    if (upvalue->isLocal) {
+      // becomes CAPTURE_VALUE if the local is never assigned
+      Capture capture = {NULL, currentChunk()->count};
+      writeCapturesArray(&current->locals.values[upvalue->index].captures,
+                         capture);
+    }
+    emitByte(upvalue->isLocal ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
+    emitShort(upvalue->index);
   }
 
   freeUpvaluesArray(&compiler.upvalues);
@@ -482,7 +626,7 @@ static void classDeclaration() {
 
   emitByte(OP_CLASS);
   emitShort(nameConstant);
-  defineVar(nameConstant);
+  defineVar(current->scopeDepth > 0 ? 0 : globalIndex(&className));
 
   ClassCompiler classCompiler;
   classCompiler.name = parser.previous;
@@ -597,6 +741,7 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+  current->lastTarget = currentChunk()->count;
 }
 
 static void and_(bool canAssign) {
@@ -647,6 +792,106 @@ static void whileStatement() {
   emitByte(OP_POP);
 }
 
+// loop after `for (var i = ...;` is `i < limit; i = i + step)` where limit
+// is a local or a number and step is a number. tokens are only peeked,
+// scanner is put back where it was
+static bool countedLoop() {
+  Token *counter = &current->locals.values[current->locals.count - 1].name;
+
+  Token tokens[10];
+  tokens[0] = parser.current;
+  Scanner saved = saveScanner();
+  for (int i = 1; i < 10; i++) tokens[i] = scanToken();
+  restoreScanner(saved);
+
+  static const TokenType shape[10] = {
+      TOKEN_IDENTIFIER, TOKEN_LESS,   TOKEN_IDENTIFIER, TOKEN_SEMICOLON,
+      TOKEN_IDENTIFIER, TOKEN_EQUAL,  TOKEN_IDENTIFIER, TOKEN_PLUS,
+      TOKEN_NUMBER,     TOKEN_RIGHT_PAREN};
+  for (int i = 0; i < 10; i++) {
+    if (tokens[i].type == shape[i]) continue;
+    if (i == 2 && tokens[i].type == TOKEN_NUMBER) continue;
+    return false;
+  }
+
+  if (!identifiersEqual(&tokens[0], counter) ||
+      !identifiersEqual(&tokens[4], counter) ||
+      !identifiersEqual(&tokens[6], counter)) {
+    return false;
+  }
+
+  // slots have to fit in one byte (number limit takes a new slot)
+  if (current->locals.count >= UINT8_COUNT) return false;
+  if (tokens[2].type == TOKEN_IDENTIFIER) {
+    int limit = resolveLocal(current, &tokens[2]);
+    if (limit == -1 || limit >= UINT8_COUNT) return false;
+  }
+  return true;
+}
+
+// for (var i = start; i < limit; i = i + step) body
+//
+//   OP_LOOP_LT i limit exit   (skip the loop when !(i < limit))
+// body:
+//   ...
+//   OP_FOR_NUM_STEP i limit step body   (i = i + step, loop if i < limit)
+// exit:
+//
+// number limit is kept in a hidden local. ops work on slots directly, so
+// the body (or a closure over i) can still assign anything to i and gets
+// the same errors as the unfused loop
+static void countedForLoop() {
+  uint8_t counter = (uint8_t)(current->locals.count - 1);
+  current->locals.values[counter].isAssigned = true;  // OP_FOR_NUM_STEP
+
+  advance();  // counter
+  advance();  // <
+  Token limitToken = parser.current;
+  int line = limitToken.line;  // errors of `i < limit` are reported here
+  advance();  // limit
+
+  uint8_t limit;
+  if (limitToken.type == TOKEN_NUMBER) {
+    double value = strtod(limitToken.start, NULL);
+    writeConstant(currentChunk(), NUM_VAL(value), line);
+    addLocal(syntheticToken(""));
+    markInitialized();
+    limit = (uint8_t)(current->locals.count - 1);
+  } else {
+    limit = (uint8_t)resolveLocal(current, &limitToken);
+  }
+
+  for (int i = 0; i < 5; i++) advance();  // ; i = i +
+  Token stepToken = parser.current;
+  uint16_t step = makeConstant(NUM_VAL(strtod(stepToken.start, NULL)));
+  advance();  // step
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses");
+
+  writeChunk(currentChunk(), OP_LOOP_LT, line);
+  writeChunk(currentChunk(), counter, line);
+  writeChunk(currentChunk(), limit, line);
+  writeChunk(currentChunk(), 0xff, line);
+  writeChunk(currentChunk(), 0xff, line);
+  int exitJump = currentChunk()->count - 2;
+
+  int bodyStart = currentChunk()->count;
+  statement();
+
+  // limit byte keeps line of the condition, the rest gets line of the
+  // increment (vm reports each error at the matching byte)
+  writeChunk(currentChunk(), OP_FOR_NUM_STEP, stepToken.line);
+  writeChunk(currentChunk(), counter, stepToken.line);
+  writeChunk(currentChunk(), limit, line);
+  writeChunk(currentChunk(), (step >> 8) & 0xff, stepToken.line);
+  writeChunk(currentChunk(), step & 0xff, stepToken.line);
+  int offset = currentChunk()->count - bodyStart + 2;
+  if (offset > UINT16_MAX) error("Loop body is too large");
+  writeChunk(currentChunk(), (offset >> 8) & 0xff, stepToken.line);
+  writeChunk(currentChunk(), offset & 0xff, stepToken.line);
+
+  patchJump(exitJump);
+}
+
 static void forStatement() {
   beginScope();
 
@@ -656,6 +901,11 @@ static void forStatement() {
     // No initializer.
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
+    if (!parser.hadError && countedLoop()) {
+      countedForLoop();
+      endScope();
+      return;
+    }
   } else {
     expressionStatement();
   }
@@ -707,8 +957,18 @@ static void returnStatement() {
       error("Can't return a value from an initializer");
     }
 
+    int start = currentChunk()->count;
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value");
+
+    // `return f(...)`: call is the last instruction and no jump lands
+    // after it. OP_RETURN stays, vm falls back to it for callees that
+    // can't take over the frame
+    Chunk *chunk = currentChunk();
+    if (current->lastCall >= start && current->lastCall == chunk->count - 2 &&
+        current->lastTarget != chunk->count) {
+      chunk->code[current->lastCall] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -737,7 +997,121 @@ static void grouping(bool canAssign) {
 }
 
 static void emitConstant(Value value) {
+  current->lastConstant = currentChunk()->count;
   writeConstant(currentChunk(), value, parser.previous.line);
+  writeBarrier((Obj *)current->function, value);
+}
+
+// true when code from offset to the end of chunk is only one OP_CONSTANT
+// (and no jump lands after it), value of the constant is put in value
+static bool constantAt(int offset, Value *value) {
+  Chunk *chunk = currentChunk();
+  if (offset < 0 || current->lastConstant != offset ||
+      current->lastTarget == chunk->count) {
+    return false;
+  }
+
+  uint16_t index;
+  if (chunk->code[offset] == OP_CONSTANT_SHORT) {
+    if (chunk->count != offset + 2) return false;
+    index = chunk->code[offset + 1];
+  } else {
+    if (chunk->count != offset + 3) return false;
+    index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  }
+
+  *value = chunk->constants.values[index];
+  return true;
+}
+
+// drops code after offset (folded operands)
+static void truncateCode(int offset) {
+  currentChunk()->count = offset;
+  current->lastConstant = -1;
+}
+
+// true when code before offset always leaves a number on the stack
+static bool numberBefore(int offset) {
+  return current->lastNumber == offset && current->lastTarget != offset;
+}
+
+static void emitNumberOp(uint8_t op) {
+  emitByte(op);
+  current->lastNumber = currentChunk()->count;
+}
+
+static void emitFolded(Value value) {
+  if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(value);
+  }
+}
+
+// computes operator on two constants, false when it has to be left for
+// runtime (mixed types are runtime errors and must stay that way)
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value *result) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUM(a);
+    double y = AS_NUM(b);
+    switch (operatorType) {
+      case TOKEN_PLUS:
+        *result = NUM_VAL(x + y);
+        return true;
+      case TOKEN_MINUS:
+        *result = NUM_VAL(x - y);
+        return true;
+      case TOKEN_STAR:
+        *result = NUM_VAL(x * y);
+        return true;
+      case TOKEN_SLASH:
+        *result = NUM_VAL(x / y);
+        return true;
+      case TOKEN_DOUBLE_STAR:
+        *result = NUM_VAL(y == 2 ? x * x : pow(x, y));  // same as OP_POWER
+        return true;
+      case TOKEN_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+      case TOKEN_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+      case TOKEN_GREATER_EQUAL:
+        *result = BOOL_VAL(!(x < y));
+        return true;
+      case TOKEN_LESS_EQUAL:
+        *result = BOOL_VAL(!(x > y));
+        return true;
+      default:
+        break;
+    }
+  }
+
+  if (operatorType == TOKEN_EQUAL_EQUAL) {
+    *result = BOOL_VAL(valuesEqual(a, b));
+    return true;
+  }
+  if (operatorType == TOKEN_BANG_EQUAL) {
+    *result = BOOL_VAL(!valuesEqual(a, b));
+    return true;
+  }
+
+  if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    // a and b are still in constants, so they are safe from GC
+    ObjString *x = AS_STRING(a);
+    ObjString *y = AS_STRING(b);
+    int length = x->length + y->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, x->chars, x->length);
+    memcpy(chars + x->length, y->chars, y->length);
+    chars[length] = '\0';
+    *result = OBJ_VAL(copyString(chars, length));
+    FREE_ARRAY(char, chars, length + 1);
+    return true;
+  }
+
+  return false;
 }
 
 static void number(bool canAssign) {
@@ -747,15 +1121,43 @@ static void number(bool canAssign) {
 
 static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
+  int start = currentChunk()->count;
 
   parsePrecedence(PREC_UNARY);
 
+  Value operand;
+  if (constantAt(start, &operand)) {
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      truncateCode(start);
+      emitConstant(NUM_VAL(-AS_NUM(operand)));
+      return;
+    }
+    if (operatorType == TOKEN_BANG) {
+      // constants are numbers and strings, they are never falsey
+      truncateCode(start);
+      emitByte(OP_FALSE);
+      return;
+    }
+  }
+
+  // !true, !false, !nil (operand is exactly one literal op)
+  Chunk *chunk = currentChunk();
+  if (operatorType == TOKEN_BANG && chunk->count == start + 1 &&
+      current->lastTarget != chunk->count) {
+    uint8_t literal = chunk->code[start];
+    if (literal == OP_TRUE || literal == OP_FALSE || literal == OP_NIL) {
+      truncateCode(start);
+      emitByte(literal == OP_TRUE ? OP_FALSE : OP_TRUE);
+      return;
+    }
+  }
+
   switch (operatorType) {
     case TOKEN_BANG:
       emitByte(OP_NOT);
       break;
     case TOKEN_MINUS:
-      emitByte(OP_NEGATE);
+      emitNumberOp(OP_NEGATE);
       break;
     default:
       return;  // unreachable
@@ -765,22 +1167,56 @@ static void unary(bool canAssign) {
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
+
+  // left operand is already emitted, check it before right one follows
+  int rightStart = currentChunk()->count;
+  Value left;
+  int leftStart = current->lastConstant;
+  bool leftConstant = constantAt(leftStart, &left);
+  bool leftNumber = numberBefore(rightStart);
+
   parsePrecedence((Precedence)(rule->precedence + 1));
+
+  Value right;
+  if (constantAt(rightStart, &right)) {
+    Value result;
+    if (leftConstant && foldBinary(operatorType, left, right, &result)) {
+      truncateCode(leftStart);
+      emitFolded(result);
+      return;
+    }
+
+    // x * 1, x / 1 and x - 0 are x when x is a number (x + 0 isn't, -0
+    // would become 0), for anything else they must still fail at runtime
+    if (leftNumber && IS_NUMBER(right)) {
+      double y = AS_NUM(right);
+      bool identity =
+          (y == 1 &&
+           (operatorType == TOKEN_STAR || operatorType == TOKEN_SLASH)) ||
+          (y == 0 && !signbit(y) && operatorType == TOKEN_MINUS);
+      if (identity) {
+        truncateCode(rightStart);
+        current->lastNumber = rightStart;
+        return;
+      }
+    }
+  }
+
   switch (operatorType) {
     case TOKEN_PLUS:
       emitByte(OP_ADD);
       break;
     case TOKEN_MINUS:
-      emitByte(OP_SUBTRACT);
+      emitNumberOp(OP_SUBTRACT);
       break;
     case TOKEN_STAR:
-      emitByte(OP_MULTIPLY);
+      emitNumberOp(OP_MULTIPLY);
       break;
     case TOKEN_SLASH:
-      emitByte(OP_DIVIDE);
+      emitNumberOp(OP_DIVIDE);
       break;
     case TOKEN_DOUBLE_STAR:
-      emitByte(OP_POWER);
+      emitNumberOp(OP_POWER);
       break;
     case TOKEN_BANG_EQUAL:
       emitBytes(OP_EQUAL, OP_NOT);
@@ -807,6 +1243,7 @@ static void binary(bool canAssign) {
 
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -834,14 +1271,17 @@ static void dot(bool canAssign) {
     expression();
     emitByte(OP_SET_PROPERTY);
     emitShort(name);
+    emitShort(makeInlineCache());
   } else if (match(TOKEN_LEFT_PAREN)) {  // if you want to call method
     uint8_t argCount = argumentList();
     emitByte(OP_INVOKE);
     emitShort(name);
     emitByte(argCount);
+    emitShort(makeInlineCache());
   } else {
     emitByte(OP_GET_PROPERTY);
     emitShort(name);
+    emitShort(makeInlineCache());
   }
 }
 
@@ -878,6 +1318,7 @@ static void super_(bool canAssign) {
     emitByte(OP_SUPER_INVOKE);
     emitShort(name);
     emitByte(argCount);
+    emitShort(makeInlineCache());
   } else {
     namedVar(syntheticToken("super"), false);
     emitByte(OP_GET_SUPER);
@@ -956,3 +1397,17 @@ void markCompilerRoots() {
     compiler = compiler->enclosing;
   }
 }
+
+void updateCompilerRoots() {
+  for (Compiler *compiler = current; compiler != NULL;
+       compiler = compiler->enclosing) {
+    compiler->function = (ObjFunc *)forwardObject((Obj *)compiler->function);
+    for (int i = 0; i < compiler->locals.count; i++) {
+      CapturesArray *captures = &compiler->locals.values[i].captures;
+      for (int j = 0; j < captures->count; j++) {
+        Capture *capture = &captures->values[j];
+        capture->function = (ObjFunc *)forwardObject((Obj *)capture->function);
+      }
+    }
+  }
+}
@@ -34,5 +34,7 @@ void declaration();
 
 // mark all compiler roots for GC
 void markCompilerRoots();
+// compiler roots to where compaction moved them (see compact.h)
+void updateCompilerRoots();
 
 #endif
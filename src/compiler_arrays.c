@@ -24,6 +24,28 @@ void freeLocalsArray(LocalsArray *array) {
   initLocalsArray(array);
 }
 
+void initCapturesArray(CapturesArray *array) {
+  array->values = NULL;
+  array->capacity = 0;
+  array->count = 0;
+}
+
+void writeCapturesArray(CapturesArray *array, Capture value) {
+  if (array->capacity < array->count + 1) {
+    int oldCapacity = array->capacity;
+    array->capacity = GROW_CAPACITY(oldCapacity);
+    array->values =
+        GROW_ARRAY(Capture, array->values, oldCapacity, array->capacity);
+  }
+  array->values[array->count] = value;
+  array->count++;
+}
+
+void freeCapturesArray(CapturesArray *array) {
+  FREE_ARRAY(Capture, array->values, array->capacity);
+  initCapturesArray(array);
+}
+
 void initUpvaluesArray(UpvaluesArray *array) {
   array->values = NULL;
   array->capacity = 0;
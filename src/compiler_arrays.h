@@ -2,12 +2,30 @@
 #define iii_compiler_arrays_h
 
 #include "common.h"
+#include "object.h"
 #include "scanner.h"
 
+// place that depends on how a local is captured: function reading it
+// through its upvalue index, or (function is NULL) capture byte of
+// OP_CLOSURE at offset index in chunk of the local's own function
+typedef struct {
+  ObjFunc *function;
+  int index;
+} Capture;
+
+typedef struct {
+  int capacity;
+  int count;
+  Capture *values;
+} CapturesArray;
+
 typedef struct {
   Token name;
   int depth;
   bool isCaptured;
+  bool isAssigned;  // written somewhere after its declaration
+  // patched when scope ends if it's never assigned (captured by value)
+  CapturesArray captures;
 } Local;
 
 typedef struct {
@@ -31,6 +49,10 @@ void initLocalsArray(LocalsArray *array);
 void writeLocalsArray(LocalsArray *array, Local value);
 void freeLocalsArray(LocalsArray *array);
 
+void initCapturesArray(CapturesArray *array);
+void writeCapturesArray(CapturesArray *array, Capture value);
+void freeCapturesArray(CapturesArray *array);
+
 void initUpvaluesArray(UpvaluesArray *array);
 void writeUpvaluesArray(UpvaluesArray *array, Upvalue value);
 void freeUpvaluesArray(UpvaluesArray *array);
@@ -5,6 +5,7 @@
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
@@ -39,13 +40,61 @@ int longConstantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  uint16_t cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+int shortConstantInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 2;
+}
+
+int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
+int shortGlobalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 2;
+}
+
 int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   uint16_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
   uint8_t argCount = chunk->code[offset + 3];
+  uint16_t cache = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
   printf("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 6;
+}
+
+int localsInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d %4d\n", name, chunk->code[offset + 1],
+         chunk->code[offset + 2]);
+  return offset + 3;
+}
+
+int localConstantInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+  printValue(chunk->constants.values[constant]);
   printf("'\n");
-  return offset + 4;
+  return offset + 3;
 }
 
 void disassembleChunk(Chunk *chunk, const char *name) {
@@ -73,6 +122,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return simpleInstruction("OP_RETURN", offset);
     case OP_CONSTANT:
       return longConstantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_SHORT:
+      return shortConstantInstruction("OP_CONSTANT_SHORT", chunk, offset);
     case OP_NEGATE:
       return simpleInstruction("OP_NEGATE", offset);
     case OP_ADD:
@@ -83,6 +134,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return simpleInstruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:
       return simpleInstruction("OP_DIVIDE", offset);
+    case OP_POWER:
+      return simpleInstruction("OP_POWER", offset);
     case OP_TRUE:
       return simpleInstruction("OP_TRUE", offset);
     case OP_FALSE:
@@ -93,6 +146,12 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:
       return simpleInstruction("OP_GREATER", offset);
+    case OP_NOT_EQUAL:
+      return simpleInstruction("OP_NOT_EQUAL", offset);
+    case OP_GREATER_EQUAL:
+      return simpleInstruction("OP_GREATER_EQUAL", offset);
+    case OP_LESS_EQUAL:
+      return simpleInstruction("OP_LESS_EQUAL", offset);
     case OP_LESS:
       return simpleInstruction("OP_LESS", offset);
     case OP_NOT:
@@ -100,23 +159,52 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case OP_POP:
       return simpleInstruction("OP_POP", offset);
     case OP_GET_GLOBAL:
-      return longConstantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return longConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_SHORT:
+      return shortGlobalInstruction("OP_GET_GLOBAL_SHORT", chunk, offset);
+    case OP_SET_GLOBAL_SHORT:
+      return shortGlobalInstruction("OP_SET_GLOBAL_SHORT", chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return longConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
       return byteInstructionLong("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
       return byteInstructionLong("OP_SET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_SHORT:
+      return byteInstruction("OP_GET_LOCAL_SHORT", chunk, offset);
+    case OP_SET_LOCAL_SHORT:
+      return byteInstruction("OP_SET_LOCAL_SHORT", chunk, offset);
     case OP_JUMP:
       return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_FALSE:
       return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+      return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_LOOP_LT: {
+      uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+      jump |= chunk->code[offset + 4];
+      printf("%-16s %4d %4d %4d -> %d\n", "OP_LOOP_LT", chunk->code[offset + 1],
+             chunk->code[offset + 2], offset, offset + 5 + jump);
+      return offset + 5;
+    }
+    case OP_FOR_NUM_STEP: {
+      uint16_t step = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+      uint16_t jump = (uint16_t)(chunk->code[offset + 5] << 8);
+      jump |= chunk->code[offset + 6];
+      printf("%-16s %4d %4d '", "OP_FOR_NUM_STEP", chunk->code[offset + 1],
+             chunk->code[offset + 2]);
+      printValue(chunk->constants.values[step]);
+      printf("' %4d -> %d\n", offset, offset + 7 - jump);
+      return offset + 7;
+    }
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_CLOSURE: {
       offset++;
       uint16_t constant = (chunk->code[offset] << 8) | chunk->code[offset + 1];
@@ -128,11 +216,14 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       ObjFunc *func = AS_FUNCTION(chunk->constants.values[constant]);
 
       for (int j = 0; j < func->upvalueCount; j++) {
-        int isLocal = chunk->code[offset++];
+        int capture = chunk->code[offset++];
         int index = ((chunk->code[offset] << 8) | (chunk->code[offset + 1]));
         offset += 2;
         printf("%04d    |                       | %s %d\n", offset - 3,
-               isLocal ? "local" : "upvalue", index);
+               capture == CAPTURE_VALUE   ? "value"
+               : capture == CAPTURE_LOCAL ? "local"
+                                          : "upvalue",
+               index);
       }
 
       return offset;
@@ -141,14 +232,22 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return byteInstructionLong("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstructionLong("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_UPVALUE_SHORT:
+      return byteInstruction("OP_GET_UPVALUE_SHORT", chunk, offset);
+    case OP_SET_UPVALUE_SHORT:
+      return byteInstruction("OP_SET_UPVALUE_SHORT", chunk, offset);
+    case OP_GET_CAPTURED:
+      return byteInstructionLong("OP_GET_CAPTURED", chunk, offset);
+    case OP_GET_CAPTURED_SHORT:
+      return byteInstruction("OP_GET_CAPTURED_SHORT", chunk, offset);
     case OP_CLOSE_UPVALUE:
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_CLASS:
       return longConstantInstruction("OP_CLASS", chunk, offset);
     case OP_GET_PROPERTY:
-      return longConstantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return longConstantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_METHOD:
       return longConstantInstruction("OP_METHOD", chunk, offset);
     case OP_INVOKE:
@@ -159,8 +258,246 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return longConstantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_ADD_NUM:
+      return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+      return simpleInstruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+      return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+      return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+      return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_NUM:
+      return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+      return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_ADD_LOCALS:
+      return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_ADD_LOCAL_CONSTANT:
+      return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      return localConstantInstruction("OP_SUBTRACT_LOCAL_CONSTANT", chunk,
+                                      offset);
+    case OP_SET_LOCAL_POP:
+      return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_LESS_LOCAL_CONSTANT_JUMP: {
+      uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+      jump |= chunk->code[offset + 4];
+      localConstantInstruction("OP_LESS_LOCAL_CONSTANT_JUMP", chunk, offset);
+      printf("%04d    |                       jump %d -> %d\n", offset,
+             offset, offset + 5 + jump);
+      return offset + 5;
+    }
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
+
+static const char *cacheStateName(InlineCacheState state) {
+  switch (state) {
+    case IC_UNINITIALIZED:
+      return "uninitialized";
+    case IC_MONOMORPHIC:
+      return "monomorphic";
+    case IC_POLYMORPHIC:
+      return "polymorphic";
+    case IC_MEGAMORPHIC:
+      return "megamorphic";
+  }
+  return "unknown";  // unreachable
+}
+
+void dumpInlineCaches(Chunk *chunk, const char *name) {
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    const char *opName;
+    int cacheOffset = 3;
+    switch (chunk->code[offset]) {
+      case OP_GET_PROPERTY:
+        opName = "get";
+        break;
+      case OP_SET_PROPERTY:
+        opName = "set";
+        break;
+      case OP_INVOKE:
+        opName = "invoke";
+        cacheOffset = 4;
+        break;
+      case OP_SUPER_INVOKE:
+        opName = "super";
+        cacheOffset = 4;
+        break;
+      default:
+        continue;
+    }
+
+    uint16_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint16_t index = (chunk->code[offset + cacheOffset] << 8) |
+                     chunk->code[offset + cacheOffset + 1];
+    InlineCache *cache = &chunk->caches[index];
+    uint32_t total = cache->hits + cache->misses;
+
+    printf("%-12s [line %4d] %-6s %-12s %-13s %10u hits %8u misses (%5.1f%%)\n",
+           name, chunk->lines[offset], opName,
+           AS_CSTRING(chunk->constants.values[constant]),
+           cacheStateName(cache->state), cache->hits, cache->misses,
+           total == 0 ? 0.0 : 100.0 * cache->hits / total);
+  }
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_TOP 20
+#define TRIPLES_MAX 4096  // distinct triples seen, more get dropped
+
+typedef struct {
+  uint32_t key;  // first << 16 | second << 8 | third, plus 1 (0 is empty)
+  uint64_t count;
+} TripleCount;
+
+static uint64_t pairCounts[UINT8_COUNT][UINT8_COUNT];
+static TripleCount tripleCounts[TRIPLES_MAX];
+static uint64_t instructionCount;
+static int previous[2] = {-1, -1};  // last two opcodes, -1 before start
+
+static const char *opNames[UINT8_COUNT] = {
+    [OP_CONSTANT] = "CONSTANT",
+    [OP_CONSTANT_SHORT] = "CONSTANT_SHORT",
+    [OP_DEFINE_GLOBAL] = "DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "GET_GLOBAL",
+    [OP_SET_GLOBAL] = "SET_GLOBAL",
+    [OP_GET_GLOBAL_SHORT] = "GET_GLOBAL_SHORT",
+    [OP_SET_GLOBAL_SHORT] = "SET_GLOBAL_SHORT",
+    [OP_SET_LOCAL] = "SET_LOCAL",
+    [OP_GET_LOCAL] = "GET_LOCAL",
+    [OP_SET_LOCAL_SHORT] = "SET_LOCAL_SHORT",
+    [OP_GET_LOCAL_SHORT] = "GET_LOCAL_SHORT",
+    [OP_GET_UPVALUE] = "GET_UPVALUE",
+    [OP_SET_UPVALUE] = "SET_UPVALUE",
+    [OP_GET_UPVALUE_SHORT] = "GET_UPVALUE_SHORT",
+    [OP_SET_UPVALUE_SHORT] = "SET_UPVALUE_SHORT",
+    [OP_GET_CAPTURED] = "GET_CAPTURED",
+    [OP_GET_CAPTURED_SHORT] = "GET_CAPTURED_SHORT",
+    [OP_CLOSE_UPVALUE] = "CLOSE_UPVALUE",
+    [OP_GET_PROPERTY] = "GET_PROPERTY",
+    [OP_SET_PROPERTY] = "SET_PROPERTY",
+    [OP_GET_SUPER] = "GET_SUPER",
+    [OP_NIL] = "NIL",
+    [OP_TRUE] = "TRUE",
+    [OP_FALSE] = "FALSE",
+    [OP_NOT] = "NOT",
+    [OP_EQUAL] = "EQUAL",
+    [OP_GREATER] = "GREATER",
+    [OP_LESS] = "LESS",
+    [OP_NOT_EQUAL] = "NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "LESS_EQUAL",
+    [OP_NEGATE] = "NEGATE",
+    [OP_ADD] = "ADD",
+    [OP_SUBTRACT] = "SUBTRACT",
+    [OP_MULTIPLY] = "MULTIPLY",
+    [OP_DIVIDE] = "DIVIDE",
+    [OP_POWER] = "POWER",
+    [OP_RETURN] = "RETURN",
+    [OP_POP] = "POP",
+    [OP_JUMP_FALSE] = "JUMP_FALSE",
+    [OP_POP_JUMP_IF_FALSE] = "POP_JUMP_IF_FALSE",
+    [OP_JUMP] = "JUMP",
+    [OP_LOOP] = "LOOP",
+    [OP_LOOP_LT] = "LOOP_LT",
+    [OP_FOR_NUM_STEP] = "FOR_NUM_STEP",
+    [OP_CALL] = "CALL",
+    [OP_TAIL_CALL] = "TAIL_CALL",
+    [OP_CLOSURE] = "CLOSURE",
+    [OP_INVOKE] = "INVOKE",
+    [OP_SUPER_INVOKE] = "SUPER_INVOKE",
+    [OP_CLASS] = "CLASS",
+    [OP_METHOD] = "METHOD",
+    [OP_INHERIT] = "INHERIT",
+    [OP_ADD_NUM] = "ADD_NUM",
+    [OP_ADD_STR] = "ADD_STR",
+    [OP_SUBTRACT_NUM] = "SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "DIVIDE_NUM",
+    [OP_GREATER_NUM] = "GREATER_NUM",
+    [OP_LESS_NUM] = "LESS_NUM",
+    [OP_ADD_LOCALS] = "ADD_LOCALS",
+    [OP_ADD_LOCAL_CONSTANT] = "ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "SUBTRACT_LOCAL_CONSTANT",
+    [OP_SET_LOCAL_POP] = "SET_LOCAL_POP",
+    [OP_LESS_LOCAL_CONSTANT_JUMP] = "LESS_LOCAL_CONSTANT_JUMP",
+};
+
+static const char *opName(int op) {
+  return opNames[op] != NULL ? opNames[op] : "?";
+}
+
+static void countTriple(uint32_t key) {
+  uint32_t index = (key * 2654435761u) % TRIPLES_MAX;
+  for (int probe = 0; probe < TRIPLES_MAX; probe++) {
+    TripleCount *entry = &tripleCounts[index];
+    if (entry->key == key || entry->key == 0) {
+      entry->key = key;
+      entry->count++;
+      return;
+    }
+    index = (index + 1) % TRIPLES_MAX;
+  }
+}
+
+void profileInstruction(uint8_t op) {
+  instructionCount++;
+  if (previous[1] != -1) pairCounts[previous[1]][op]++;
+  if (previous[0] != -1) {
+    countTriple(((uint32_t)previous[0] << 16 | previous[1] << 8 | op) + 1);
+  }
+  previous[0] = previous[1];
+  previous[1] = op;
+}
+
+void dumpOpcodeProfile() {
+  printf("== opcode profile: %llu instructions ==\n",
+         (unsigned long long)instructionCount);
+  if (instructionCount == 0) return;
+
+  // top entries are picked by repeated scans (and cleared), it only runs
+  // once at exit
+  printf("-- pairs --\n");
+  for (int n = 0; n < PROFILE_TOP; n++) {
+    int bestA = -1, bestB = -1;
+    uint64_t best = 0;
+    for (int a = 0; a < UINT8_COUNT; a++) {
+      for (int b = 0; b < UINT8_COUNT; b++) {
+        uint64_t count = pairCounts[a][b];
+        if (count > best) {
+          best = count;
+          bestA = a;
+          bestB = b;
+        }
+      }
+    }
+    if (bestA == -1) break;
+    printf("%12llu %5.1f%%  %s %s\n", (unsigned long long)best,
+           100.0 * best / instructionCount, opName(bestA), opName(bestB));
+    pairCounts[bestA][bestB] = 0;
+  }
+
+  printf("-- triples --\n");
+  for (int n = 0; n < PROFILE_TOP; n++) {
+    TripleCount *best = NULL;
+    for (int i = 0; i < TRIPLES_MAX; i++) {
+      TripleCount *entry = &tripleCounts[i];
+      if (entry->key != 0 && (best == NULL || entry->count > best->count)) {
+        best = entry;
+      }
+    }
+    if (best == NULL) break;
+    uint32_t key = best->key - 1;
+    printf("%12llu %5.1f%%  %s %s %s\n", (unsigned long long)best->count,
+           100.0 * best->count / instructionCount, opName(key >> 16),
+           opName((key >> 8) & 0xff), opName(key & 0xff));
+    best->key = 0;
+  }
+}
+#endif
@@ -6,4 +6,15 @@
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+// print state and hit rate of every inline cache in chunk
+void dumpInlineCaches(Chunk* chunk, const char* name);
+
+#ifdef DEBUG_PROFILE_OPCODES
+// count opcode in pairs and triples with the ones executed before it
+// (in dispatch order, so sequences across jumps and calls count too)
+void profileInstruction(uint8_t op);
+// print the most frequent pairs and triples
+void dumpOpcodeProfile();
+#endif
+
 #endif
@@ -0,0 +1,506 @@
+// posix_memalign
+#define _POSIX_C_SOURCE 200112L
+
+#include "heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// closures keep their upvalues inline, so they come in size classes and
+// every class is a kind: OBJ_CLOSURE is the smallest one, the rest follow
+// kinds of other types (see closureClass)
+#define CLOSURE_KINDS 12
+#define OBJ_KINDS (OBJ_TYPE_COUNT + CLOSURE_KINDS)
+#define KINDS (OBJ_KINDS + CELL_CLASSES)
+
+// cells start after the header, on a granule
+#define FIRST_CELL                                              \
+  ((sizeof(Segment) + SEGMENT_GRANULE - 1) / SEGMENT_GRANULE * \
+   SEGMENT_GRANULE)
+
+typedef struct {
+  Segment *first;
+  Segment *last;
+  int cellSize;                    // 0 until first segment is made
+  uint64_t starts[SEGMENT_WORDS];  // bits of granules where cells start
+
+  // allocation goes through segments from first to last
+  Segment *current;
+  int word;
+
+  // statistics
+  int segments;
+  size_t allocations;
+} Kind;
+
+// segment is evacuated by compaction only when less of it is used
+#define EVACUATE_OCCUPANCY 0.5
+// compaction is worth it when it gives back this many segments and at
+// least 1 / COMPACT_RATIO of them
+#define COMPACT_MIN_SEGMENTS 4
+#define COMPACT_RATIO 8
+
+static Kind kinds[KINDS];
+
+static Segment **objectSegments = NULL;
+static int objectSegmentsCount = 0;
+static int objectSegmentsCapacity = 0;
+
+static Segment **youngSegments = NULL;
+static int youngSegmentsCount = 0;
+static int youngSegmentsCapacity = 0;
+
+static uint32_t sweepCycle = 0;
+
+// ObjType of objects in kind, -1 for raw cells
+static int kindType(int kind) {
+  if (kind < OBJ_TYPE_COUNT) return kind;
+  return kind < OBJ_KINDS ? OBJ_CLOSURE : -1;
+}
+
+// objects that have to go through freeObj, others are freed just by
+// clearing their bits
+static bool ownsMemory(int kind) {
+  switch (kindType(kind)) {
+    case OBJ_STRING:
+    case OBJ_FUNCTION:
+    case OBJ_CLASS:
+    case OBJ_INSTANCE:
+    case OBJ_SHAPE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// size classes of closures: granules up to 128 bytes, then powers of 2
+static int closureClass(size_t size, size_t *cellSize) {
+  int sizeClass = 0;
+  *cellSize = 32;
+  while (*cellSize < size) {
+    *cellSize += *cellSize < 128 ? SEGMENT_GRANULE : *cellSize;
+    sizeClass++;
+  }
+  return sizeClass;
+}
+
+// kind of object and size of its cell
+static int objectKind(ObjType type, size_t size, size_t *cellSize) {
+  if (type != OBJ_CLOSURE) {
+    *cellSize = CELL_SIZE(CELL_CLASS(size));
+    return type;
+  }
+
+  int sizeClass = closureClass(size, cellSize);
+  return sizeClass == 0 ? OBJ_CLOSURE : OBJ_TYPE_COUNT + sizeClass - 1;
+}
+
+static Segment *newSegment(int kindIndex) {
+  Kind *kind = &kinds[kindIndex];
+
+  void *memory;
+  if (posix_memalign(&memory, SEGMENT_SIZE, SEGMENT_SIZE) != 0) {
+    perror("Can't allocate heap segment (FATAL)\n");
+    exit(1);
+  }
+
+  Segment *segment = (Segment *)memory;
+  segment->next = NULL;
+  segment->kind = kindIndex;
+  segment->cellSize = kind->cellSize;
+  segment->sweptCycle = sweepCycle;
+  segment->evacuating = false;
+  segment->young = false;
+  memset(segment->marks, 0, sizeof(segment->marks));
+  memset(segment->cells, 0, sizeof(segment->cells));
+
+  if (kind->last == NULL) {
+    kind->first = segment;
+  } else {
+    kind->last->next = segment;
+  }
+  kind->last = segment;
+  kind->segments++;
+
+  if (kindIndex < OBJ_KINDS) {
+    if (objectSegmentsCount == objectSegmentsCapacity) {
+      objectSegmentsCapacity = GROW_CAPACITY(objectSegmentsCapacity);
+      objectSegments = realloc(objectSegments,
+                               sizeof(Segment *) * objectSegmentsCapacity);
+      if (objectSegments == NULL) exit(1);
+    }
+    objectSegments[objectSegmentsCount++] = segment;
+  }
+
+  return segment;
+}
+
+static void initKind(Kind *kind, size_t size) {
+  kind->cellSize = (int)((size + SEGMENT_GRANULE - 1) / SEGMENT_GRANULE *
+                         SEGMENT_GRANULE);
+  memset(kind->starts, 0, sizeof(kind->starts));
+  for (size_t offset = FIRST_CELL; offset + kind->cellSize <= SEGMENT_SIZE;
+       offset += kind->cellSize) {
+    size_t bit = offset / SEGMENT_GRANULE;
+    kind->starts[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+}
+
+static void addYoungSegment(Segment *segment) {
+  if (youngSegmentsCount == youngSegmentsCapacity) {
+    youngSegmentsCapacity = GROW_CAPACITY(youngSegmentsCapacity);
+    youngSegments =
+        realloc(youngSegments, sizeof(Segment *) * youngSegmentsCapacity);
+    if (youngSegments == NULL) exit(1);
+  }
+  segment->young = true;
+  youngSegments[youngSegmentsCount++] = segment;
+}
+
+static void *allocate(int kindIndex, size_t size) {
+  Kind *kind = &kinds[kindIndex];
+  if (kind->cellSize == 0) initKind(kind, size);
+  kind->allocations++;
+
+  for (;;) {
+    Segment *segment = kind->current;
+    if (segment == NULL) {
+      segment = newSegment(kindIndex);
+      kind->current = segment;
+      kind->word = 0;
+    }
+
+    if (segment->evacuating) kind->word = SEGMENT_WORDS;
+    if (!isSwept(segment)) vm.bytesAllocated -= sweepSegment(segment);
+
+    for (; kind->word < SEGMENT_WORDS; kind->word++) {
+      uint64_t free = kind->starts[kind->word] & ~segment->cells[kind->word];
+      if (free == 0) continue;
+
+      int bit = __builtin_ctzll(free);
+      segment->cells[kind->word] |= (uint64_t)1 << bit;
+      if (!segment->young && kindIndex < OBJ_KINDS) addYoungSegment(segment);
+      return (char *)segment + (kind->word * 64 + bit) * SEGMENT_GRANULE;
+    }
+
+    kind->current = segment->next;
+    kind->word = 0;
+  }
+}
+
+size_t heapObjectSize(ObjType type, size_t size) {
+  size_t cellSize;
+  objectKind(type, size, &cellSize);
+  return cellSize;
+}
+
+Obj *heapAllocObject(ObjType type, size_t size) {
+  size_t cellSize;
+  int kind = objectKind(type, size, &cellSize);
+  return (Obj *)allocate(kind, cellSize);
+}
+
+void *heapAllocCell(int sizeClass) {
+  return allocate(OBJ_KINDS + sizeClass, CELL_SIZE(sizeClass));
+}
+
+void heapFreeCell(void *cell) {
+  size_t bit = SEGMENT_BIT(cell);
+  SEGMENT_OF(cell)->cells[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+void heapFreeCellAtomic(void *cell) {
+  size_t bit = SEGMENT_BIT(cell);
+  __atomic_fetch_and(&SEGMENT_OF(cell)->cells[bit / 64],
+                     ~((uint64_t)1 << (bit % 64)), __ATOMIC_RELAXED);
+}
+
+int objectSegmentCount() { return objectSegmentsCount; }
+
+Segment *objectSegment(int index) { return objectSegments[index]; }
+
+int youngSegmentCount() { return youngSegmentsCount; }
+
+Segment *youngSegment(int index) { return youngSegments[index]; }
+
+void forgetYoungSegments() {
+  for (int i = 0; i < youngSegmentsCount; i++) {
+    youngSegments[i]->young = false;
+  }
+  youngSegmentsCount = 0;
+}
+
+void clearMarks(Segment *segment) {
+  memset(segment->marks, 0, sizeof(segment->marks));
+}
+
+size_t sweepSegment(Segment *segment) {
+  segment->sweptCycle = sweepCycle;
+  bool owns = ownsMemory(segment->kind);
+
+  size_t freed = 0;
+  for (int i = 0; i < SEGMENT_WORDS; i++) {
+    uint64_t dead = segment->cells[i] & ~segment->marks[i];
+    if (dead == 0) continue;
+
+    freed += __builtin_popcountll(dead);
+    for (uint64_t bits = dead; owns && bits != 0; bits &= bits - 1) {
+      int bit = i * 64 + __builtin_ctzll(bits);
+      freeObj((Obj *)((char *)segment + bit * SEGMENT_GRANULE));
+    }
+    segment->cells[i] &= ~dead;
+  }
+
+  return freed * segment->cellSize;
+}
+
+void startSweeping() { sweepCycle++; }
+
+bool isSwept(Segment *segment) {
+  // raw cells are freed one by one, never swept
+  return segment->sweptCycle == sweepCycle || segment->kind >= OBJ_KINDS;
+}
+
+void resetAllocation() {
+  for (int i = 0; i < KINDS; i++) {
+    kinds[i].current = kinds[i].first;
+    kinds[i].word = 0;
+  }
+}
+
+static void forEachCell(Segment *segment, void (*fn)(Obj *obj)) {
+  for (int i = 0; i < SEGMENT_WORDS; i++) {
+    for (uint64_t bits = segment->cells[i]; bits != 0; bits &= bits - 1) {
+      int bit = i * 64 + __builtin_ctzll(bits);
+      fn((Obj *)((char *)segment + bit * SEGMENT_GRANULE));
+    }
+  }
+}
+
+static int liveCells(Segment *segment) {
+  int live = 0;
+  for (int i = 0; i < SEGMENT_WORDS; i++) {
+    live += __builtin_popcountll(segment->cells[i]);
+  }
+  return live;
+}
+
+int liveObjects(ObjType type, size_t *bytes) {
+  int live = 0;
+  *bytes = 0;
+  for (int i = 0; i < OBJ_KINDS; i++) {
+    if (kindType(i) != (int)type) continue;
+
+    int kindLive = 0;
+    for (Segment *segment = kinds[i].first; segment != NULL;
+         segment = segment->next) {
+      if (!segment->evacuating) kindLive += liveCells(segment);
+    }
+    live += kindLive;
+    *bytes += (size_t)kindLive * kinds[i].cellSize;
+  }
+  return live;
+}
+
+void forEachObject(ObjType type, void (*fn)(Obj *obj)) {
+  for (int i = 0; i < OBJ_KINDS; i++) {
+    if (kindType(i) != (int)type) continue;
+
+    for (Segment *segment = kinds[i].first; segment != NULL;
+         segment = segment->next) {
+      if (!segment->evacuating) forEachCell(segment, fn);
+    }
+  }
+}
+
+static int cellsPerSegment(Kind *kind) {
+  return (int)((SEGMENT_SIZE - FIRST_CELL) / kind->cellSize);
+}
+
+typedef struct {
+  Segment *segment;
+  int live;
+} Occupancy;
+
+static int compareOccupancy(const void *a, const void *b) {
+  return ((const Occupancy *)a)->live - ((const Occupancy *)b)->live;
+}
+
+// count of sparsest segments whose cells fit into free cells of the
+// others, they are flagged as evacuating when evacuate is set
+static int planEvacuation(Kind *kind, bool evacuate) {
+  if (kind->segments < 2) return 0;
+
+  Occupancy *segments = malloc(sizeof(Occupancy) * kind->segments);
+  if (segments == NULL) return 0;
+
+  int perSegment = cellsPerSegment(kind);
+  int count = 0;
+  size_t room = 0;
+  for (Segment *segment = kind->first; segment != NULL;
+       segment = segment->next) {
+    segments[count].segment = segment;
+    segments[count].live = liveCells(segment);
+    room += perSegment - segments[count].live;
+    count++;
+  }
+  qsort(segments, count, sizeof(Occupancy), compareOccupancy);
+
+  int evacuated = 0;
+  size_t moved = 0;
+  for (int i = 0; i < count; i++) {
+    if (segments[i].live >= perSegment * EVACUATE_OCCUPANCY) break;
+
+    // free cells of evacuated segment can't take moved objects
+    size_t left = room - (perSegment - segments[i].live);
+    if (moved + segments[i].live > left) break;
+
+    room = left;
+    moved += segments[i].live;
+    if (evacuate) segments[i].segment->evacuating = true;
+    evacuated++;
+  }
+
+  free(segments);
+  return evacuated;
+}
+
+bool heapFragmented() {
+  int segments = 0;
+  int evacuated = 0;
+  for (int i = 0; i < KINDS; i++) {
+    segments += kinds[i].segments;
+    evacuated += planEvacuation(&kinds[i], false);
+  }
+  return evacuated >= COMPACT_MIN_SEGMENTS &&
+         evacuated * COMPACT_RATIO >= segments;
+}
+
+int selectEvacuation() {
+  int evacuated = 0;
+  for (int i = 0; i < KINDS; i++) {
+    evacuated += planEvacuation(&kinds[i], true);
+  }
+  return evacuated;
+}
+
+void evacuateObjects(void (*moved)(Obj *from, Obj *to)) {
+  resetAllocation();  // moved objects fill holes from the first segments
+
+  // allocation can add segments to objectSegments
+  for (int i = 0; i < objectSegmentsCount; i++) {
+    Segment *segment = objectSegments[i];
+    if (!segment->evacuating) continue;
+
+    for (int j = 0; j < SEGMENT_WORDS; j++) {
+      for (uint64_t bits = segment->cells[j]; bits != 0; bits &= bits - 1) {
+        int bit = j * 64 + __builtin_ctzll(bits);
+        Obj *from = (Obj *)((char *)segment + bit * SEGMENT_GRANULE);
+        Obj *to = (Obj *)allocate(segment->kind, segment->cellSize);
+        memcpy(to, from, segment->cellSize);
+        setMarked(to);  // everything left after full collection is old
+        moved(from, to);
+        *(Obj **)(from + 1) = to;
+      }
+    }
+  }
+}
+
+void *evacuateCell(void *cell) {
+  Segment *segment = SEGMENT_OF(cell);
+  if (!segment->evacuating) return cell;
+
+  void *to = allocate(segment->kind, segment->cellSize);
+  memcpy(to, cell, segment->cellSize);
+  return to;
+}
+
+int releaseEvacuated() {
+  int kept = 0;
+  for (int i = 0; i < objectSegmentsCount; i++) {
+    if (!objectSegments[i]->evacuating) {
+      objectSegments[kept++] = objectSegments[i];
+    }
+  }
+  objectSegmentsCount = kept;
+
+  kept = 0;
+  for (int i = 0; i < youngSegmentsCount; i++) {
+    if (!youngSegments[i]->evacuating) youngSegments[kept++] = youngSegments[i];
+  }
+  youngSegmentsCount = kept;
+
+  int released = 0;
+  for (int i = 0; i < KINDS; i++) {
+    Kind *kind = &kinds[i];
+    Segment **link = &kind->first;
+    kind->last = NULL;
+    while (*link != NULL) {
+      Segment *segment = *link;
+      if (segment->evacuating) {
+        *link = segment->next;
+        free(segment);
+        kind->segments--;
+        released++;
+      } else {
+        kind->last = segment;
+        link = &segment->next;
+      }
+    }
+  }
+
+  resetAllocation();
+  return released;
+}
+
+void freeHeap() {
+  // objects first, they free their chars into raw segments
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    if (ownsMemory(i)) forEachObject(i, freeObj);
+  }
+
+  for (int i = 0; i < KINDS; i++) {
+    Segment *segment = kinds[i].first;
+    while (segment != NULL) {
+      Segment *next = segment->next;
+      free(segment);
+      segment = next;
+    }
+    memset(&kinds[i], 0, sizeof(Kind));
+  }
+
+  free(objectSegments);
+  objectSegments = NULL;
+  objectSegmentsCount = 0;
+  objectSegmentsCapacity = 0;
+  free(youngSegments);
+  youngSegments = NULL;
+  youngSegmentsCount = 0;
+  youngSegmentsCapacity = 0;
+}
+
+void printHeapStats() {
+  printf("  heap segments:\n");
+  for (int i = 0; i < KINDS; i++) {
+    Kind *kind = &kinds[i];
+    if (kind->segments == 0) continue;
+
+    size_t live = 0;
+    for (Segment *segment = kind->first; segment != NULL;
+         segment = segment->next) {
+      live += liveCells(segment);
+    }
+    size_t perSegment = cellsPerSegment(kind);
+
+    int type = kindType(i);
+    printf("    %-12s %5d", type == -1 ? "chars" : objTypeNames[type],
+           kind->cellSize);
+    printf("%4d segments %8zu live %8zu free %10zu allocated\n",
+           kind->segments, live, kind->segments * perSegment - live,
+           kind->allocations);
+  }
+}
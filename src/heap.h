@@ -0,0 +1,122 @@
+#ifndef iii_heap_h
+#define iii_heap_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+
+// Heap is made of SEGMENT_SIZE segments aligned to their size. Segment
+// holds cells of one kind: objects of one ObjType (closures of one size
+// class too) or raw blocks (chars of short strings) of one size class. Which cells are in use and which
+// objects are marked lives in two bitmaps in segment's header, one bit for
+// every SEGMENT_GRANULE bytes (cells start on granules), so marking writes
+// only to bitmaps and sweep is a scan over them. Objects are touched by
+// sweep only when they own more memory (strings, tables, chunks...)
+//
+// use allocateCell/allocateObjectMemory from memory.h, they keep
+// vm.bytesAllocated right and run GC
+
+#define SEGMENT_SIZE 65536
+#define SEGMENT_GRANULE 16
+#define SEGMENT_BITS (SEGMENT_SIZE / SEGMENT_GRANULE)
+#define SEGMENT_WORDS (SEGMENT_BITS / 64)
+
+// raw blocks up to this size are cells, bigger ones use reallocate
+#define CELL_MAX_SIZE 128
+#define CELL_CLASSES (CELL_MAX_SIZE / SEGMENT_GRANULE)
+#define CELL_CLASS(size) \
+  ((int)(((size) + SEGMENT_GRANULE - 1) / SEGMENT_GRANULE) - 1)
+#define CELL_SIZE(sizeClass) ((size_t)((sizeClass) + 1) * SEGMENT_GRANULE)
+
+typedef struct Segment {
+  struct Segment *next;  // next segment of the same kind
+  int kind;              // objects of one type and size, or raw cells
+  int cellSize;
+  uint32_t sweptCycle;  // last cycle that swept it (lazy sweep)
+  bool evacuating;      // compaction moves its cells out (see compact.h)
+  bool young;           // in young segments (see youngSegment)
+  uint64_t marks[SEGMENT_WORDS];
+  uint64_t cells[SEGMENT_WORDS];  // cells in use
+} Segment;
+
+#define SEGMENT_OF(pointer) \
+  ((Segment *)((uintptr_t)(pointer) & ~(uintptr_t)(SEGMENT_SIZE - 1)))
+#define SEGMENT_BIT(pointer) \
+  (((uintptr_t)(pointer) & (SEGMENT_SIZE - 1)) / SEGMENT_GRANULE)
+
+static inline bool isMarked(Obj *obj) {
+  size_t bit = SEGMENT_BIT(obj);
+  return (SEGMENT_OF(obj)->marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void setMarked(Obj *obj) {
+  size_t bit = SEGMENT_BIT(obj);
+  SEGMENT_OF(obj)->marks[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+// where compaction moved object (its old cell keeps the new address after
+// the header), object itself when it doesn't move
+static inline Obj *forwardObject(Obj *obj) {
+  if (obj == NULL || !SEGMENT_OF(obj)->evacuating) return obj;
+  return *(Obj **)(obj + 1);
+}
+
+// size of the cell object of size gets
+size_t heapObjectSize(ObjType type, size_t size);
+// doesn't run GC (callers do that before)
+Obj *heapAllocObject(ObjType type, size_t size);
+void *heapAllocCell(int sizeClass);
+void heapFreeCell(void *cell);
+// for threads that free cells at the same time (see parallel_gc.h)
+void heapFreeCellAtomic(void *cell);
+
+// object segments in the order they were made, new ones are only added to
+// the end
+int objectSegmentCount();
+Segment *objectSegment(int index);
+
+// object segments that got new cells since the last collection, between
+// full cycles only they can have young (unmarked) objects, so minor
+// collection sweeps just them
+int youngSegmentCount();
+Segment *youngSegment(int index);
+void forgetYoungSegments();
+
+// every object unmarked (full collection starts with this)
+void clearMarks(Segment *segment);
+
+// frees unmarked objects of segment, returns bytes of freed cells
+size_t sweepSegment(Segment *segment);
+
+// sweep of a full cycle starts. until sweepSegment gets to a segment,
+// allocation sweeps it first (see GC_SWEEP)
+void startSweeping();
+bool isSwept(Segment *segment);
+
+// allocation goes back to first segments, so cells freed by sweep are
+// used again
+void resetAllocation();
+
+// count and bytes of allocated objects of type (all live after full cycle)
+int liveObjects(ObjType type, size_t *bytes);
+
+// calls fn for every allocated object of type (not the old copies of
+// objects that compaction moved)
+void forEachObject(ObjType type, void (*fn)(Obj *obj));
+
+// compaction of fully swept heap: sparsest segments of every kind are
+// flagged as evacuating (as many as the rest has room for), their cells
+// are moved into the rest and then segments go back to the system
+bool heapFragmented();  // worth compacting
+int selectEvacuation();
+// moves objects, moved is called before the old cell gets forward address
+void evacuateObjects(void (*moved)(Obj *from, Obj *to));
+// raw cell moves when the segment it's in is evacuating
+void *evacuateCell(void *cell);
+int releaseEvacuated();  // returns count of released segments
+
+void freeHeap();
+void printHeapStats();
+
+#endif
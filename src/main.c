@@ -1,11 +1,17 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
+// environment variable with GC options (same as on command line)
+#define GC_OPTIONS_ENV "III_GC"
+
 static char *readFile(const char *path) {
   FILE *file = fopen(path, "rb");
   fseek(file, 0L, SEEK_END);
@@ -45,18 +51,124 @@ static void repl() {
   }
 }
 
+static void usage() {
+  fprintf(stderr,
+          "Usage: iii [--gc-pause=<microseconds>] [--gc-threads=<count>] "
+          "[--gc-compact] [--gc-stats]\n"
+          "           [--gc-growth=<ratio>] [--gc-min-heap=<size>] "
+          "[--gc-soft-limit=<size>]\n"
+          "           [--gc-hard-limit=<size>] [path]\n"
+          "GC options can be given in " GC_OPTIONS_ENV
+          " too, sizes are bytes or end with K, M or G\n");
+  exit(1);
+}
+
+static bool printStats = false;
+
+// before freeVM, or at exit() of script or error
+static void reportStats() {
+  if (!printStats) return;
+  printStats = false;
+  printGCStats();
+}
+
+// bytes with optional K, M or G suffix
+static bool parseSize(const char *text, size_t *size) {
+  if (*text < '0' || *text > '9') return false;  // strtoull takes "-1"
+
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (errno == ERANGE || value > SIZE_MAX) return false;
+
+  int shift = 0;
+  switch (*end) {
+    case 'K': shift = 10; end++; break;
+    case 'M': shift = 20; end++; break;
+    case 'G': shift = 30; end++; break;
+    default: break;
+  }
+  if (*end != '\0' || value > SIZE_MAX >> shift) return false;
+
+  *size = (size_t)value << shift;
+  return true;
+}
+
+// one --gc-* option, false when it isn't a valid one
+static bool gcOption(const char *arg) {
+  if (strncmp(arg, "--gc-pause=", 11) == 0) {
+    // time budget of one incremental GC step
+    int micros = atoi(arg + 11);
+    if (micros <= 0) return false;
+    vm.gcMaxPause = micros / 1000000.0;
+  } else if (strncmp(arg, "--gc-threads=", 13) == 0) {
+    // marking and sweeping threads, 1 is serial collector
+    int threads = atoi(arg + 13);
+    if (threads <= 0) return false;
+    vm.gcThreads = threads;
+  } else if (strcmp(arg, "--gc-stats") == 0) {
+    // report of collector counters at exit (exit() from script too)
+    if (!printStats) atexit(reportStats);
+    printStats = true;
+  } else if (strcmp(arg, "--gc-compact") == 0) {
+    // move objects out of sparse heap segments after full collections
+    vm.gcCompact = true;
+  } else if (strncmp(arg, "--gc-growth=", 12) == 0) {
+    // heap grows this many times over live objects before next cycle
+    double growth = atof(arg + 12);
+    if (growth <= 1) return false;
+    vm.gcGrowth = growth;
+  } else if (strncmp(arg, "--gc-min-heap=", 14) == 0) {
+    if (!parseSize(arg + 14, &vm.gcMinHeap)) return false;
+    vm.nextGC = vm.gcMinHeap;  // first collection
+  } else if (strncmp(arg, "--gc-soft-limit=", 16) == 0) {
+    return parseSize(arg + 16, &vm.gcSoftLimit);
+  } else if (strncmp(arg, "--gc-hard-limit=", 16) == 0) {
+    return parseSize(arg + 16, &vm.gcHardLimit);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// options from environment are separated by spaces, command line ones
+// override them
+static void gcOptionsFromEnv() {
+  const char *env = getenv(GC_OPTIONS_ENV);
+  if (env == NULL) return;
+
+  char options[1024];
+  if (strlen(env) >= sizeof(options)) usage();
+  strcpy(options, env);
+
+  for (char *option = strtok(options, " "); option != NULL;
+       option = strtok(NULL, " ")) {
+    if (!gcOption(option)) usage();
+  }
+}
+
 int main(int argc, const char *argv[]) {
   initVM();
+  gcOptionsFromEnv();
+
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--gc-", 5) == 0) {
+      if (!gcOption(argv[i])) usage();
+    } else if (path == NULL && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
 
-  if (argc == 1) {
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: iii [path]\n");
-    exit(1);
+    runFile(path);
   }
 
+  reportStats();
   freeVM();
 
   return 0;
@@ -1,11 +1,16 @@
 // #include <cstddef>
 #include "memory.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "object.h"
+#include "parallel_gc.h"
+#include "heap.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -14,18 +19,52 @@
 #include <stdio.h>
 #endif /* ifdef DEBUG_LOG_GC */
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
+// after allocation of bytes, runs collection that is due
+static void allocated(size_t bytes) {
+  vm.youngBytes += bytes;
+  vm.gcStats.totalAllocated += bytes;
+
+  // allocation can't fail here (callers expect memory), so run() raises
+  // the error at its next safe point (loop or call)
+  if (vm.gcHardLimit > 0 && vm.bytesAllocated > vm.gcHardLimit &&
+      !vm.outOfMemory) {
+    collectGarbage();
+    if (vm.bytesAllocated > vm.gcHardLimit) vm.outOfMemory = true;
+    return;
+  }
 
-  if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
+  // minor collection or incremental step every time, full cycle (and
+  // compaction) now and then
+  static int stressCount = 0;
+  stressCount++;
+  if (vm.gcPhase != GC_IDLE) {
+    gcStep();
+  } else if (stressCount % 64 == 0) {
     collectGarbage();
+    if (vm.gcCompact) vm.compactPending = true;  // at next safe point
+  } else if (stressCount % 8 == 0) {
+    startCycle();
+  } else {
+    collectYoung();
+  }
 #endif /* ifdef DEBUG_STRESS_GC */
 
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
-    }
+  if (vm.gcPhase != GC_IDLE) {
+    if (vm.bytesAllocated > vm.nextStep) gcStep();
+  } else if (vm.bytesAllocated > vm.nextGC) {
+    startCycle();
+    gcStep();
+  } else if (vm.youngBytes > GC_NURSERY_SIZE) {
+    collectYoung();
   }
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  if (newSize == 0 && parallelFree(pointer, oldSize)) return NULL;
+
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) allocated(newSize - oldSize);
 
   if (newSize == 0) {
     free(pointer);
@@ -33,14 +72,106 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   }
 
   void *res = realloc(pointer, newSize);
-  if (res == NULL) exit(1);
+  if (res == NULL) {
+    // garbage can be what is missing
+    collectGarbage();
+    res = realloc(pointer, newSize);
+  }
+  if (res == NULL) {
+    perror("Can't allocate memory (FATAL)\n");
+    exit(1);
+  }
 
   return res;
 }
 
+void *allocateCell(size_t size) {
+  if (size > CELL_MAX_SIZE) return reallocate(NULL, 0, size);
+
+  int sizeClass = CELL_CLASS(size);
+  vm.bytesAllocated += CELL_SIZE(sizeClass);
+  allocated(CELL_SIZE(sizeClass));
+  return heapAllocCell(sizeClass);
+}
+
+void freeCell(void *pointer, size_t size) {
+  if (size > CELL_MAX_SIZE) {
+    reallocate(pointer, size, 0);
+    return;
+  }
+
+  int sizeClass = CELL_CLASS(size);
+  if (parallelFreeCell(pointer, sizeClass)) return;
+
+  vm.bytesAllocated -= CELL_SIZE(sizeClass);
+  heapFreeCell(pointer);
+}
+
+Obj *allocateObjectMemory(ObjType type, size_t size) {
+  size_t cellSize = heapObjectSize(type, size);
+  vm.bytesAllocated += cellSize;
+  allocated(cellSize);
+  return heapAllocObject(type, size);
+}
+
+static double gcClock() { return (double)clock() / CLOCKS_PER_SEC; }
+
+static void recordPause(double seconds) {
+  long micros = (long)(seconds * 1000000);
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && (1L << bucket) <= micros) {
+    bucket++;
+  }
+  vm.gcStats.pauses[bucket]++;
+  vm.gcStats.totalPause += seconds;
+  if (seconds > vm.gcStats.maxPause) vm.gcStats.maxPause = seconds;
+}
+
+// allocation rate since previous collection (minor or full)
+static void collectionEnded(double now) {
+  GCStats *stats = &vm.gcStats;
+  if (now > stats->lastEnd) {
+    stats->allocationRate = (stats->totalAllocated - stats->lastEndAllocated) /
+                            (now - stats->lastEnd);
+  }
+  stats->lastEnd = now;
+  stats->lastEndAllocated = stats->totalAllocated;
+}
+
+static void cycleEnded() {
+  GCStats *stats = &vm.gcStats;
+  stats->cycles++;
+
+  // minor collections don't run during cycle, all frees are its
+  size_t allocated = stats->totalAllocated - stats->cycleStartAllocated;
+  stats->lastFreed = stats->cycleStartBytes + allocated - vm.bytesAllocated;
+  stats->totalFreed += stats->lastFreed;
+  collectionEnded(gcClock());
+}
+
+// objects handled by incremental step between checks of its time budget
+#define GC_STEP_WORK 64
+#define GC_SEGMENT_WORK 64
+
+static void pushGray(Obj *obj) {
+  obj->isRemembered = true;  // gray until blackened
+
+  if (vm.grayCapacity < vm.grayCount + 1) {
+    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    vm.grayStack = realloc(vm.grayStack, vm.grayCapacity * sizeof(Obj *));
+    if (vm.grayStack == NULL) {  // some problems with allocating = aborting
+      perror("Gray stack problem (FATAL)\n");
+      exit(1);
+    }
+  }
+
+  vm.grayStack[vm.grayCount++] = obj;
+}
+
 void markObject(Obj *obj) {
   if (obj == NULL) return;
-  if (obj->isMarked) return;  // prevent infinite loop
+  if (parallelMarkObject(obj)) return;
+  if (isMarked(obj)) return;  // prevent infinite loop
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void *)obj);
@@ -48,18 +179,48 @@ void markObject(Obj *obj) {
   printf("\n");
 #endif /* ifdef DEBUG_LOG_GC */
 
-  obj->isMarked = true;
+  setMarked(obj);
+  pushGray(obj);
+}
 
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack = realloc(vm.grayStack, vm.grayCapacity * sizeof(Obj *));
-    if (vm.grayStack == NULL) {  // some problems with allocating = aborting
-      perror("Gray stack problem (FATAL)\n");
+void rememberObject(Obj *obj) {
+  // young objects are traced by minor collection anyway
+  if (!isMarked(obj) || obj->isRemembered) return;
+
+  // everything gets traced again after unmarking anyway
+  if (vm.gcPhase == GC_PREPARE) return;
+
+  // black object goes back to gray, so it's traced again with the new
+  // reference before marking ends
+  if (vm.gcPhase == GC_MARK) {
+    pushGray(obj);
+    return;
+  }
+
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered =
+        realloc(vm.remembered, vm.rememberedCapacity * sizeof(Obj *));
+    if (vm.remembered == NULL) {
+      perror("Remembered set problem (FATAL)\n");
       exit(1);
     }
   }
 
-  vm.grayStack[vm.grayCount++] = obj;
+  obj->isRemembered = true;
+  vm.remembered[vm.rememberedCount++] = obj;
+}
+
+// cached bound methods can be garbage, cache doesn't keep them alive
+static void forgetBoundMethods() {
+  memset(vm.boundMethods, 0, sizeof(vm.boundMethods));
+}
+
+static void forgetRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
 }
 
 void markValue(Value value) {
@@ -73,7 +234,20 @@ static void markArray(ValueArray *array) {
   }
 }
 
-static void freeObj(Obj *obj) {
+// shapes and methods in inline caches are kept alive, so cache can't hit
+// with a new object that got address of a freed one
+static void markInlineCaches(Chunk *chunk) {
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    InlineCache *cache = &chunk->caches[i];
+    for (int j = 0; j < cache->count; j++) {
+      markObject(cache->entries[j].key);
+      markObject((Obj *)cache->entries[j].transition);
+      markObject((Obj *)cache->entries[j].method);
+    }
+  }
+}
+
+void freeObj(Obj *obj) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d ", (void *)obj, obj->type);
   printValue(OBJ_VAL(obj));
@@ -83,39 +257,38 @@ static void freeObj(Obj *obj) {
   switch (obj->type) {
     case OBJ_STRING:
       ObjString *string = (ObjString *)obj;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, obj);
+      FREE_CELL(char, string->chars, string->length + 1);
       break;
     case OBJ_FUNCTION: {
       ObjFunc *func = (ObjFunc *)obj;
       freeChunk(&func->chunk);
-      FREE(ObjFunc, obj);
       break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, obj);
       break;
-    case OBJ_CLOSURE: {
-      ObjClosure *closure = (ObjClosure *)obj;
-      FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-      break;
-    }
+    case OBJ_CLOSURE:
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, obj);
       break;
     case OBJ_CLASS:
       ObjClass *cclass = (ObjClass *)obj;
       freeTable(&cclass->methods);
-      FREE(ObjClass, obj);
       break;
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance *)obj;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, obj);
+      FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+      if (instance->dictionary != NULL) {
+        freeTable(instance->dictionary);
+        FREE(Table, instance->dictionary);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape *)obj;
+      freeTable(&shape->slots);
+      freeTable(&shape->transitions);
       break;
     }
     case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, obj);
       break;
     default:
       break;
@@ -123,16 +296,10 @@ static void freeObj(Obj *obj) {
 }
 
 void freeObjects() {
-  // CS 101 textbook implementation of walking a linked list and freeing its
-  // nodes
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    Obj *next = object->next;
-    freeObj(object);
-    object = next;
-  }
+  freeHeap();
 
   free(vm.grayStack);
+  free(vm.remembered);
 }
 
 static void markRoots() {
@@ -153,7 +320,9 @@ static void markRoots() {
   }
 
   // table of globals
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
 
   // mark compiler roots
   markCompilerRoots();
@@ -168,6 +337,8 @@ void blackenObject(Obj *obj) {
 
 #endif /* ifdef DEBUG_LOG_GC */
 
+  obj->isRemembered = false;
+
   switch (obj->type) {
     case OBJ_NATIVE:
     case OBJ_STRING:
@@ -179,13 +350,14 @@ void blackenObject(Obj *obj) {
       ObjFunc *func = (ObjFunc *)obj;
       markObject((Obj *)func->name);
       markArray(&func->chunk.constants);
+      markInlineCaches(&func->chunk);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure *closure = (ObjClosure *)obj;
       markObject((Obj *)closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj *)closure->upvalues[i]);
+        markValue(closure->upvalues[i]);
       }
       break;
     }
@@ -193,12 +365,28 @@ void blackenObject(Obj *obj) {
       ObjClass *cclass = (ObjClass *)obj;
       markObject((Obj *)cclass->name);
       markTable(&cclass->methods);
+      markObject((Obj *)cclass->rootShape);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance *)obj;
       markObject((Obj *)instance->cclass);
-      markTable(&instance->fields);
+      if (instance->shape != NULL) {
+        markObject((Obj *)instance->shape);
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+          markValue(instance->fields[i]);
+        }
+      } else {
+        markTable(instance->dictionary);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape *)obj;
+      markObject((Obj *)shape->parent);
+      markObject((Obj *)shape->name);
+      markTable(&shape->slots);
+      markTable(&shape->transitions);
       break;
     }
     case OBJ_BOUND_METHOD:
@@ -210,55 +398,258 @@ void blackenObject(Obj *obj) {
 }
 
 void trackReferences() {
+  if (vm.gcThreads > 1) {
+    parallelTrackReferences();
+    return;
+  }
+
   while (vm.grayCount > 0) {
     Obj *obj = vm.grayStack[--vm.grayCount];
     blackenObject(obj);
   }
 }
 
-static void sweep() {
-  Obj *previous = NULL;
-  Obj *obj = vm.objects;
-  while (obj != NULL) {
-    if (obj->isMarked) {
-      obj->isMarked = false;
-      previous = obj;
-      obj = obj->next;
-    } else {
-      Obj *unreached = obj;
+// frees unmarked objects of segments that aren't swept yet, marked ones
+// stay marked (old)
+static void sweepAll() {
+  if (vm.gcThreads > 1) {
+    parallelSweep(false);
+    return;
+  }
 
-      obj = obj->next;
-      if (previous != NULL) {
-        previous->next = obj;
-      } else {
-        vm.objects = obj;
-      }
+  for (int i = 0; i < objectSegmentCount(); i++) {
+    Segment *segment = objectSegment(i);
+    if (!isSwept(segment)) vm.bytesAllocated -= sweepSegment(segment);
+  }
+}
 
-      freeObj(unreached);
+// segments with old objects only have nothing to free
+static void sweepYoung() {
+  if (vm.gcThreads > 1) {
+    parallelSweep(true);
+  } else {
+    for (int i = 0; i < youngSegmentCount(); i++) {
+      vm.bytesAllocated -= sweepSegment(youngSegment(i));
     }
   }
+  forgetYoungSegments();
 }
 
-void collectGarbage() {
+void collectYoung() {
+  // old objects aren't all marked while a full cycle runs
+  if (vm.gcPhase != GC_IDLE) return;
+
 #ifdef DEBUG_LOG_GC
-  printf(" -- GC begin\n");
+  printf(" -- minor GC begin\n");
 #endif /* ifdef DEBUG_LOG_GC */
+  size_t before = vm.bytesAllocated;
+  double start = gcClock();
 
-  // mark all roots
+  // old objects are already marked, so marking stops at them
   markRoots();
-  // trace references of roots
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+  forgetRemembered();
   trackReferences();
-  // vm.strings have different behaviour (weak reference)
   tableRemoveWhite(&vm.strings);
-  // sweep (delete) unmarked objects
-  sweep();
+  forgetBoundMethods();
+
+  // old objects are marked, so only young ones can be freed
+  sweepYoung();
+  resetAllocation();
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.youngBytes = 0;
+  vm.gcStats.minorCollections++;
+  vm.gcStats.totalFreed += before - vm.bytesAllocated;
+  double end = gcClock();
+  collectionEnded(end);
+  recordPause(end - start);
 
 #ifdef DEBUG_LOG_GC
-  printf(" -- GC end\n");
-  size_t before = vm.bytesAllocated;
-  printf("  collected %ld bytes (from %ld to %ld) next at %ld\n\n",
+  printf(" -- minor GC end\n");
+  printf("  collected %zu bytes (from %zu to %zu) next at %zu\n",
          before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+  printHeapStats();
+  printf("\n");
+#endif /* ifdef DEBUG_LOG_GC */
+}
+
+// Full collection runs in small steps between mutator allocations:
+//   GC_PREPARE - mark bitmaps are cleared (old objects are marked since
+//                they survived, see generations above)
+//   GC_MARK    - gray objects are blackened. mutator keeps running, so old
+//                write barrier re-grays black object that gets a white
+//                reference (rememberObject). roots aren't protected by
+//                barrier and are marked again in final (atomic) step
+//   GC_SWEEP   - segments are swept one by one, allocation sweeps
+//                segment it wants to use first if sweeper isn't there yet
+// minor collections wait until the cycle is done
+
+void startCycle() {
+  if (vm.gcPhase != GC_IDLE) return;
+
+#ifdef DEBUG_LOG_GC
+  printf(" -- GC cycle begin\n");
+#endif /* ifdef DEBUG_LOG_GC */
+
+  forgetRemembered();
+  vm.gcCursor = 0;
+  vm.gcPhase = GC_PREPARE;
+  vm.gcStats.cycleStartBytes = vm.bytesAllocated;
+  vm.gcStats.cycleStartAllocated = vm.gcStats.totalAllocated;
+  vm.nextStep = vm.bytesAllocated;
+}
+
+// end of marking, short stop-the-world part of the cycle
+static void finishMark() {
+  markRoots();
+  trackReferences();
+  // vm.strings have different behaviour (weak reference)
+  tableRemoveWhite(&vm.strings);
+  forgetBoundMethods();
+
+  // cycle sweeps every segment, new cells after this are young again
+  startSweeping();
+  forgetYoungSegments();
+  vm.gcCursor = 0;
+  vm.youngBytes = 0;
+  vm.gcPhase = GC_SWEEP;
+}
+
+// over soft limit heap grows by 1 / GC_SOFT_GROWTH of live bytes
+#define GC_SOFT_GROWTH 8
+
+// heap size that starts the next cycle after live bytes survived this one
+static size_t nextCollection(size_t live) {
+  size_t next = (size_t)(live * vm.gcGrowth);
+  if (next < vm.gcMinHeap) next = vm.gcMinHeap;
+  if (vm.gcSoftLimit == 0 || next <= vm.gcSoftLimit) return next;
+
+  // near the soft limit heap grows by half of what is left to it, over it
+  // only by a small part of live bytes (cycles would follow each other)
+  size_t room = live < vm.gcSoftLimit ? (vm.gcSoftLimit - live) / 2 : 0;
+  if (room < live / GC_SOFT_GROWTH) room = live / GC_SOFT_GROWTH;
+  if (room < GC_STEP_SIZE) room = GC_STEP_SIZE;
+  return live + room;
+}
+
+// does about count objects of work, returns false when cycle is done
+static bool gcWork(int count) {
+  // segment of bitmaps is worth this many objects
+  int segments = count / GC_SEGMENT_WORK > 0 ? count / GC_SEGMENT_WORK : 1;
+
+  switch (vm.gcPhase) {
+    case GC_IDLE:
+      return false;
+    case GC_PREPARE:
+      while (segments-- > 0 && vm.gcCursor < objectSegmentCount()) {
+        clearMarks(objectSegment(vm.gcCursor++));
+      }
+      if (vm.gcCursor == objectSegmentCount()) {
+        vm.gcPhase = GC_MARK;
+        markRoots();
+      }
+      return true;
+    case GC_MARK:
+      while (count-- > 0 && vm.grayCount > 0) {
+        blackenObject(vm.grayStack[--vm.grayCount]);
+      }
+      if (vm.grayCount == 0) finishMark();
+      return true;
+    case GC_SWEEP:
+      while (segments > 0 && vm.gcCursor < objectSegmentCount()) {
+        Segment *segment = objectSegment(vm.gcCursor++);
+        if (isSwept(segment)) continue;
+        vm.bytesAllocated -= sweepSegment(segment);
+        segments--;
+      }
+      if (vm.gcCursor < objectSegmentCount()) return true;
+
+      resetAllocation();
+      vm.nextGC = nextCollection(vm.bytesAllocated);
+      vm.gcPhase = GC_IDLE;
+      cycleEnded();
+      // objects can't move here, run() compacts at next safe point
+      if (vm.gcCompact && heapFragmented()) vm.compactPending = true;
+
+#ifdef DEBUG_LOG_GC
+      printf(" -- GC cycle end\n");
+      printf("  freed %zu bytes, heap %zu bytes, next at %zu\n",
+             vm.gcStats.lastFreed, vm.bytesAllocated, vm.nextGC);
+      printHeapStats();
+      printf("\n");
 #endif /* ifdef DEBUG_LOG_GC */
+      return false;
+  }
+
+  return false;
+}
+
+void gcStep() {
+  double start = gcClock();
+
+#ifdef DEBUG_STRESS_GC
+  // tiny steps, so mutator runs between as many of them as possible
+  gcWork(1);
+#else
+  // mutator allocates faster than steps keep up, heap can't grow forever
+  // (or over soft limit)
+  bool finish = vm.bytesAllocated > vm.nextGC * vm.gcGrowth ||
+                (vm.gcSoftLimit > 0 && vm.bytesAllocated > vm.gcSoftLimit);
+  while (gcWork(GC_STEP_WORK)) {
+    if (!finish && gcClock() - start >= vm.gcMaxPause) break;
+  }
+#endif /* ifdef DEBUG_STRESS_GC */
+
+  vm.nextStep = vm.bytesAllocated + GC_STEP_SIZE;
+  recordPause(gcClock() - start);
+}
+
+// rest of the cycle at once
+static void finishSweep() {
+  sweepAll();
+  gcWork(INT_MAX);  // everything is swept, ends the cycle
+}
+
+void collectGarbage() {
+  double start = gcClock();
+
+  // cycle that already marked can't see garbage made since, start a new one
+  if (vm.gcPhase == GC_SWEEP) finishSweep();
+  startCycle();
+  while (vm.gcPhase == GC_PREPARE) gcWork(INT_MAX);
+  if (vm.gcPhase == GC_MARK) finishMark();
+  finishSweep();
+
+  recordPause(gcClock() - start);
+}
+
+void printGCStats() {
+  GCStats *stats = &vm.gcStats;
+  fprintf(stderr, "== GC stats ==\n");
+  fprintf(stderr, "  collections %d full, %d minor\n", stats->cycles,
+          stats->minorCollections);
+  fprintf(stderr, "  pauses %.3f ms total, %.3f ms longest\n",
+          stats->totalPause * 1000, stats->maxPause * 1000);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (stats->pauses[i] == 0) continue;
+    if (i == GC_PAUSE_BUCKETS - 1) {
+      fprintf(stderr, "    >= %6ld us %8d\n", 1L << (i - 1), stats->pauses[i]);
+    } else {
+      fprintf(stderr, "    <  %6ld us %8d\n", 1L << i, stats->pauses[i]);
+    }
+  }
+  fprintf(stderr, "  allocated %zu bytes, freed %zu (last cycle %zu)\n",
+          stats->totalAllocated, stats->totalFreed, stats->lastFreed);
+  fprintf(stderr, "  allocation rate %.0f bytes/s, heap %zu bytes\n",
+          stats->allocationRate, vm.bytesAllocated);
+  fprintf(stderr, "  objects in heap:\n");
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    size_t bytes;
+    int count = liveObjects(type, &bytes);
+    if (count == 0) continue;
+    fprintf(stderr, "    %-12s %8d objects %10zu bytes\n", objTypeNames[type],
+            count, bytes);
+  }
 }
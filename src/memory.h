@@ -2,6 +2,7 @@
 #define iii_memory_h
 
 #include "common.h"
+#include "heap.h"
 #include "object.h"
 #include "value.h"
 
@@ -18,7 +19,17 @@
 
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
+// small blocks (chars of strings) are cells of heap segments (heap.h),
+// bigger ones fall back to reallocate
+#define ALLOCATE_CELL(type, count) (type*)allocateCell(sizeof(type) * (count))
+#define FREE_CELL(type, pointer, count) \
+  freeCell(pointer, sizeof(type) * (count))
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateCell(size_t size);
+void freeCell(void* pointer, size_t size);
+// memory of new object, freed by sweep when object isn't marked
+Obj* allocateObjectMemory(ObjType type, size_t size);
 void freeObjects();
 
 // NOTE:
@@ -27,8 +38,50 @@ void freeObjects();
 // gray  - reachable, but we haven't traced through it
 // black - mark phase done for this object
 
+// Generations: object that survives a collection keeps its mark bit and
+// is old from then on (sticky mark bits, nothing is moved). minor
+// collection (collectYoung) marks only young objects reachable from roots
+// and from remembered old objects, then sweeps young list only. full
+// collection (collectGarbage) unmarks everything and traces whole heap.
+//
+// old object that gets a reference to a young one has to go through
+// writeBarrier right after the store, before anything can allocate.
+// stack, globals and other roots are scanned by every collection and
+// don't need it
+
+// Full collection is incremental: startCycle begins it and gcStep does
+// work of at most vm.gcMaxPause at a time (see phases in memory.c).
+// old write barrier below is its marking barrier too: black object
+// getting a white reference is grayed again. collectGarbage finishes
+// whole full collection at once
+
 void collectGarbage();
+void collectYoung();
+void startCycle();
+void gcStep();
 void markObject(Obj* obj);
 void markValue(Value value);
+void blackenObject(Obj* obj);
+// frees memory object owns (not object itself)
+void freeObj(Obj* obj);
+// any reference of obj can be young now (no-op for young obj)
+void rememberObject(Obj* obj);
+
+// report of vm.gcStats (--gc-stats)
+void printGCStats();
+
+static inline void writeBarrier(Obj* owner, Value value) {
+  if (!owner->isRemembered && IS_OBJ(value) && isMarked(owner) &&
+      !isMarked(AS_OBJ(value))) {
+    rememberObject(owner);
+  }
+}
+
+static inline void writeBarrierObj(Obj* owner, Obj* obj) {
+  if (!owner->isRemembered && obj != NULL && isMarked(owner) &&
+      !isMarked(obj)) {
+    rememberObject(owner);
+  }
+}
 
 #endif
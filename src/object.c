@@ -11,12 +11,18 @@
 #define ALLOCATE_OBJ(type, objectType) \
   (type *)allocateObject(sizeof(type), objectType)
 
+const char *objTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",     [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",     [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance", [OBJ_CLOSURE] = "closure",
+    [OBJ_UPVALUE] = "upvalue",   [OBJ_BOUND_METHOD] = "boundMethod",
+    [OBJ_SHAPE] = "shape",
+};
+
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *obj = (Obj *)reallocate(NULL, 0, size);
+  Obj *obj = allocateObjectMemory(type, size);
   obj->type = type;
-  obj->isMarked = false;
-  obj->next = vm.objects;
-  vm.objects = obj;
+  obj->isRemembered = false;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %ld for %d\n", (void *)obj, size, type);
@@ -57,7 +63,7 @@ ObjString *takeString(char *chars, int length) {
   ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
 
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    FREE_CELL(char, chars, length + 1);
     return interned;
   }
 
@@ -71,7 +77,7 @@ ObjString *copyString(const char *chars, int length) {
 
   if (interned != NULL) return interned;
 
-  char *heapChars = ALLOCATE(char, length + 1);
+  char *heapChars = ALLOCATE_CELL(char, length + 1);
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
   return allocateString(heapChars, length, hash);
@@ -111,6 +117,9 @@ void printObject(Value value) {
     case OBJ_BOUND_METHOD:
       printFunc(AS_BOUND_METHOD(value)->method->function);
       break;
+    case OBJ_SHAPE:
+      printf("<shape %d>", AS_SHAPE(value)->fieldCount);
+      break;
     default:
       printf("Unknown object type\n");
   }
@@ -121,6 +130,7 @@ ObjFunc *newFunction() {
   func->arity = 0;
   func->name = NULL;
   func->upvalueCount = 0;
+  func->maxStack = 0;
   initChunk(&func->chunk);
   return func;
 }
@@ -132,16 +142,14 @@ ObjNative *newNative(NativeFn function) {
 }
 
 ObjClosure *newClosure(ObjFunc *function) {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
-
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
-
-  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure *closure = (ObjClosure *)allocateObject(
+      sizeof(ObjClosure) + sizeof(Value) * function->upvalueCount,
+      OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i] = NIL_VAL;
+  }
   return closure;
 }
 
@@ -156,14 +164,26 @@ ObjUpvalue *newUpvalue(Value *slot) {
 ObjClass *newClass(ObjString *name) {
   ObjClass *cclass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   cclass->name = name;
+  cclass->version = 0;
+  cclass->rootShape = NULL;
   initTable(&cclass->methods);
   return cclass;
 }
 
+// ! cclass must be reachable for GC (caller keeps it on the stack)
 ObjInstance *newInstance(ObjClass *cclass) {
+  // root shape is created with first instance of the class
+  if (cclass->rootShape == NULL) {
+    cclass->rootShape = newShape(NULL, NULL);
+    writeBarrierObj((Obj *)cclass, (Obj *)cclass->rootShape);
+  }
+
   ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->cclass = cclass;
-  initTable(&instance->fields);
+  instance->shape = cclass->rootShape;
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+  instance->dictionary = NULL;
   return instance;
 }
 
@@ -174,3 +194,112 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
   bound->method = method;
   return bound;
 }
+
+ObjShape *newShape(ObjShape *parent, ObjString *name) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  return shape;
+}
+
+int shapeSlot(ObjShape *shape, ObjString *name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int)AS_NUM(slot);
+}
+
+// finds (or creates) shape that is 'shape' plus field 'name'
+static ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+
+  ObjShape *child = newShape(shape, name);
+
+  push(OBJ_VAL(child));  // keep child safe from GC while filling it
+  tableAddAll(&shape->slots, &child->slots);
+  tableSet(&child->slots, name, NUM_VAL(shape->fieldCount));
+  rememberObject((Obj *)child);  // could get old while tables grew
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  rememberObject((Obj *)shape);
+  pop();
+
+  return child;
+}
+
+// moves all fields into instance's own table, used when instance gets too
+// many fields for shapes to be worth it
+static void toDictionaryMode(ObjInstance *instance) {
+  Table *dictionary = ALLOCATE(Table, 1);
+  initTable(dictionary);
+
+  Table *slots = &instance->shape->slots;
+  for (int i = 0; i <= slots->capacity; i++) {
+    Entry *entry = &slots->entries[i];
+    if (entry->key == NULL) continue;
+    tableSet(dictionary, entry->key,
+             instance->fields[(int)AS_NUM(entry->value)]);
+  }
+
+  FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+  instance->shape = NULL;
+  instance->dictionary = dictionary;
+  rememberObject((Obj *)instance);
+}
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value) {
+  if (instance->shape == NULL) {
+    return tableGet(instance->dictionary, name, value);
+  }
+
+  int slot = shapeSlot(instance->shape, name);
+  if (slot == -1) return false;
+
+  *value = instance->fields[slot];
+  return true;
+}
+
+// ! instance and value must be reachable for GC (caller keeps them on stack)
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+      instance->fields[slot] = value;
+      writeBarrier((Obj *)instance, value);
+      return;
+    }
+
+    if (instance->shape->fieldCount >= SHAPE_MAX_FIELDS) {
+      toDictionaryMode(instance);
+    }
+  }
+
+  if (instance->shape == NULL) {
+    tableSet(instance->dictionary, name, value);
+    rememberObject((Obj *)instance);
+    return;
+  }
+
+  instanceAddField(instance, shapeTransition(instance->shape, name), value);
+}
+
+void instanceAddField(ObjInstance *instance, ObjShape *next, Value value) {
+  if (next->fieldCount > instance->fieldCapacity) {
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+    instance->fields =
+        GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+    instance->fieldCapacity = capacity;
+  }
+
+  instance->fields[next->fieldCount - 1] = value;
+  instance->shape = next;
+  writeBarrier((Obj *)instance, value);
+  writeBarrierObj((Obj *)instance, (Obj *)next);
+}
@@ -11,7 +11,8 @@
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
-#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD);
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
@@ -21,6 +22,8 @@
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -33,12 +36,20 @@ typedef enum {
   OBJ_CLOSURE,
   OBJ_UPVALUE,
   OBJ_BOUND_METHOD,
+  OBJ_SHAPE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_SHAPE + 1)
+
+// names of types for statistics
+extern const char *objTypeNames[OBJ_TYPE_COUNT];
+
+// mark bit is in the bitmap of object's heap segment (see heap.h), outside
+// of collection marked object is one that survived one (old object)
 struct Obj {
   ObjType type;
-  struct Obj *next;
-  bool isMarked;
+  bool isRemembered;  // old object in vm.remembered (see writeBarrier),
+                      // gray one while collector marks
 };
 
 static inline bool isObjType(Value value, ObjType type) {
@@ -49,6 +60,7 @@ typedef struct {
   Obj obj;
   int arity;
   uint16_t upvalueCount;
+  int maxStack;  // most stack slots frame uses, callee and arguments too
   Chunk chunk;
   ObjString *name;
 } ObjFunc;
@@ -73,23 +85,50 @@ typedef struct ObjUpvalue {
   struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+// closure is a single heap cell (upvalues are inline), so there is a limit
+#define UPVALUES_MAX 256
+
+// upvalue is OBJ_VAL of ObjUpvalue, or the value itself when the variable
+// is never assigned (captured by value, read by OP_GET_CAPTURED)
+typedef struct ObjClosure {
   Obj obj;
   ObjFunc *function;
-  ObjUpvalue **upvalues;
   int upvalueCount;
+  Value upvalues[];
 } ObjClosure;
 
+// instances with more fields than this stop using shapes and keep their
+// fields in their own table (dictionary mode)
+#define SHAPE_MAX_FIELDS 64
+
+// Shape (hidden class) describes layout of instance fields: which field lives
+// in which slot of the instance's flat fields array. Shapes are shared by all
+// instances that got the same fields in the same order and form a tree,
+// every added field is a transition from one shape to the next.
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape *parent;  // NULL for root (empty) shape
+  ObjString *name;          // field added by transition from parent
+  int fieldCount;           // count of fields (and used slots)
+  Table slots;              // field name -> slot index
+  Table transitions;        // added field name -> next shape
+} ObjShape;
+
 typedef struct {
   Obj obj;
   ObjString *name;
   Table methods;
+  uint32_t version;     // bumped on every change of methods
+  ObjShape *rootShape;  // shape of instances without fields
 } ObjClass;
 
 typedef struct {
   Obj obj;
   ObjClass *cclass;  // cclas because class is reserved in Objective C/C++
-  Table fields;
+  ObjShape *shape;   // NULL when instance is in dictionary mode
+  Value *fields;     // field values, indexed by slots of shape
+  int fieldCapacity;
+  Table *dictionary;  // fields in dictionary mode
 } ObjInstance;
 
 typedef struct {
@@ -98,6 +137,7 @@ typedef struct {
   ObjClosure *method;
 } ObjBoundMethod;
 
+// chars must come from ALLOCATE_CELL(char, length + 1)
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
 
@@ -110,5 +150,16 @@ ObjUpvalue *newUpvalue(Value *slot);
 ObjClass *newClass(ObjString *name);
 ObjInstance *newInstance(ObjClass *cclass);
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+
+// returns slot of field in shape or -1 if shape doesn't have it
+int shapeSlot(ObjShape *shape, ObjString *name);
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value);
+
+// moves instance to shape 'next' (transition from its current shape) and
+// stores value of the added field
+void instanceAddField(ObjInstance *instance, ObjShape *next, Value value);
 
 #endif  // iii_object_h
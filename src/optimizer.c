@@ -0,0 +1,481 @@
+#include "optimizer.h"
+
+#include "memory.h"
+
+typedef struct {
+  uint8_t op;
+  int offset;  // offset in original code
+  int length;
+  int line;
+
+  int target;     // index of instruction jump lands on (-1 if not a jump)
+  bool isTarget;  // some jump lands here, so it can't be fused or dropped
+  bool removed;
+
+  int newOffset;
+
+  // superinstruction gets operands of the fused instructions, jump offset
+  // (if any) is written over the last two by emit
+  bool fused;
+  uint8_t operands[4];
+} Instruction;
+
+typedef struct {
+  uint8_t ops[4];  // instructions to fuse
+  int length;
+  uint8_t op;            // superinstruction replacing them
+  bool numberConstant;   // CONSTANT_SHORT in sequence must load a number
+} Superinstruction;
+
+// picked from opcode profiles of loops (see DEBUG_PROFILE_OPCODES), longer
+// sequences go first
+static const Superinstruction superinstructions[] = {
+    {{OP_GET_LOCAL_SHORT, OP_CONSTANT_SHORT, OP_LESS, OP_POP_JUMP_IF_FALSE},
+     4,
+     OP_LESS_LOCAL_CONSTANT_JUMP,
+     true},
+    {{OP_GET_LOCAL_SHORT, OP_GET_LOCAL_SHORT, OP_ADD}, 3, OP_ADD_LOCALS, false},
+    {{OP_GET_LOCAL_SHORT, OP_CONSTANT_SHORT, OP_ADD},
+     3,
+     OP_ADD_LOCAL_CONSTANT,
+     true},
+    {{OP_GET_LOCAL_SHORT, OP_CONSTANT_SHORT, OP_SUBTRACT},
+     3,
+     OP_SUBTRACT_LOCAL_CONSTANT,
+     true},
+    {{OP_SET_LOCAL_SHORT, OP_POP}, 2, OP_SET_LOCAL_POP, false},
+};
+
+static bool isJump(uint8_t op) {
+  if (op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_FALSE ||
+      op == OP_POP_JUMP_IF_FALSE || op == OP_LOOP_LT ||
+      op == OP_FOR_NUM_STEP) {
+    return true;
+  }
+
+  // superinstruction jumps when a fused instruction does, so a new one
+  // can't be missed by maxStackDepth
+  int superCount = sizeof(superinstructions) / sizeof(superinstructions[0]);
+  for (int s = 0; s < superCount; s++) {
+    if (superinstructions[s].op != op) continue;
+    for (int i = 0; i < superinstructions[s].length; i++) {
+      if (isJump(superinstructions[s].ops[i])) return true;
+    }
+  }
+  return false;
+}
+
+static bool isBackward(uint8_t op) {
+  return op == OP_LOOP || op == OP_FOR_NUM_STEP;
+}
+
+static bool isUnconditional(uint8_t op) {
+  return op == OP_JUMP || op == OP_LOOP;
+}
+
+static int nextLive(Instruction *code, int count, int i) {
+  for (i++; i < count; i++) {
+    if (!code[i].removed) return i;
+  }
+  return count;
+}
+
+// jump to removed instruction lands on the next live one
+static int resolve(Instruction *code, int count, int i) {
+  if (i < count && code[i].removed) return nextLive(code, count, i);
+  return i;
+}
+
+static void markTargets(Instruction *code, int count) {
+  for (int i = 0; i < count; i++) code[i].isTarget = false;
+
+  for (int i = 0; i < count; i++) {
+    if (code[i].removed || code[i].target == -1) continue;
+    code[i].target = resolve(code, count, code[i].target);
+    if (code[i].target < count) code[code[i].target].isTarget = true;
+  }
+}
+
+static void retarget(Instruction *code, int i, int target) {
+  code[i].target = target;
+  code[target].isTarget = true;
+}
+
+// final destination of jump i, following jumps that would be taken anyway
+static int threadJump(Instruction *code, int count, int i) {
+  int target = resolve(code, count, code[i].target);
+
+  for (int steps = 0; steps < count && target < count; steps++) {
+    Instruction *next = &code[target];
+
+    // JUMP_FALSE doesn't pop, so JUMP_FALSE it lands on sees the same value
+    bool follow = isUnconditional(next->op) ||
+                  (code[i].op == OP_JUMP_FALSE && next->op == OP_JUMP_FALSE);
+    if (!follow) break;
+
+    int nextTarget = resolve(code, count, next->target);
+    if (nextTarget >= count) break;
+    // conditional jumps can only go forward
+    if (!isUnconditional(code[i].op) && nextTarget <= i) break;
+    target = nextTarget;
+  }
+
+  return target;
+}
+
+static bool peephole(Instruction *code, int count) {
+  bool changed = false;
+
+  markTargets(code, count);
+
+  for (int i = 0; i < count; i++) {
+    Instruction *instr = &code[i];
+    if (instr->removed) continue;
+
+    int next = nextLive(code, count, i);
+    Instruction *nextInstr = next < count ? &code[next] : NULL;
+
+    switch (instr->op) {
+      case OP_EQUAL:
+      case OP_LESS:
+      case OP_GREATER:
+        if (nextInstr != NULL && nextInstr->op == OP_NOT &&
+            !nextInstr->isTarget) {
+          if (instr->op == OP_EQUAL) {
+            instr->op = OP_NOT_EQUAL;
+          } else if (instr->op == OP_LESS) {
+            instr->op = OP_GREATER_EQUAL;
+          } else {
+            instr->op = OP_LESS_EQUAL;
+          }
+          nextInstr->removed = true;
+          changed = true;
+        }
+        break;
+
+      case OP_JUMP:
+      case OP_LOOP:
+      case OP_JUMP_FALSE:
+      case OP_POP_JUMP_IF_FALSE: {
+        int target = threadJump(code, count, i);
+        if (target != instr->target) {
+          retarget(code, i, target);
+          changed = true;
+        }
+
+        // jump to next instruction does nothing (JUMP_FALSE doesn't pop)
+        if (target == next && instr->op != OP_POP_JUMP_IF_FALSE) {
+          instr->removed = true;
+          if (instr->isTarget && next < count) code[next].isTarget = true;
+          changed = true;
+          break;
+        }
+
+        // JUMP_FALSE, POP ... target: POP - both edges pop the condition
+        if (instr->op == OP_JUMP_FALSE && nextInstr != NULL &&
+            nextInstr->op == OP_POP && !nextInstr->isTarget &&
+            code[target].op == OP_POP) {
+          int afterPop = nextLive(code, count, target);
+          if (afterPop < count) {
+            instr->op = OP_POP_JUMP_IF_FALSE;
+            retarget(code, i, afterPop);
+            nextInstr->removed = true;
+            changed = true;
+          }
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+
+    // nothing falls through into code after these, only jumps can reach it
+    if (!instr->removed &&
+        (isUnconditional(instr->op) || instr->op == OP_RETURN)) {
+      for (int j = nextLive(code, count, i); j < count && !code[j].isTarget;
+           j = nextLive(code, count, j)) {
+        code[j].removed = true;
+        changed = true;
+      }
+    }
+  }
+
+  return changed;
+}
+
+static bool matches(Chunk *chunk, Instruction **seq, int length,
+                    const Superinstruction *super) {
+  if (length < super->length) return false;
+
+  for (int i = 0; i < super->length; i++) {
+    if (seq[i]->op != super->ops[i]) return false;
+    if (super->numberConstant && seq[i]->op == OP_CONSTANT_SHORT) {
+      uint8_t constant = chunk->code[seq[i]->offset + 1];
+      if (!IS_NUMBER(chunk->constants.values[constant])) return false;
+    }
+  }
+  return true;
+}
+
+static void fuseSequence(Chunk *chunk, Instruction **seq,
+                         const Superinstruction *super) {
+  Instruction *first = seq[0];
+  int length = 1;
+
+  for (int i = 0; i < super->length; i++) {
+    Instruction *instr = seq[i];
+    for (int b = 1; b < instr->length; b++) {
+      first->operands[length++ - 1] = chunk->code[instr->offset + b];
+    }
+
+    // error would come from the last one that isn't a jump
+    if (instr->target == -1) first->line = instr->line;
+    if (i == 0) continue;
+
+    if (instr->target != -1) first->target = instr->target;
+    instr->removed = true;
+  }
+
+  first->op = super->op;
+  first->length = length;
+  first->fused = true;
+}
+
+// replaces frequent sequences with superinstructions, runs after peephole
+// so it sees final code. only the first fused instruction may be a target
+static void fuse(Chunk *chunk, Instruction *code, int count) {
+  int superCount = sizeof(superinstructions) / sizeof(superinstructions[0]);
+
+  markTargets(code, count);
+
+  for (int i = 0; i < count; i++) {
+    if (code[i].removed) continue;
+
+    Instruction *seq[4];
+    int length = 0;
+    for (int j = i; j < count && length < 4; j = nextLive(code, count, j)) {
+      if (length > 0 && code[j].isTarget) break;
+      seq[length++] = &code[j];
+    }
+
+    for (int s = 0; s < superCount; s++) {
+      if (matches(chunk, seq, length, &superinstructions[s])) {
+        fuseSequence(chunk, seq, &superinstructions[s]);
+        break;
+      }
+    }
+  }
+}
+
+static void writeShort(Chunk *chunk, int offset, int value) {
+  chunk->code[offset] = (value >> 8) & 0xff;
+  chunk->code[offset + 1] = value & 0xff;
+}
+
+// writes live instructions back, code only shrinks so it's done in place
+static void emit(Chunk *chunk, Instruction *code, int count) {
+  int offset = 0;
+  for (int i = 0; i < count; i++) {
+    if (code[i].removed) continue;
+    code[i].newOffset = offset;
+    offset += code[i].length;
+  }
+
+  for (int i = 0; i < count; i++) {
+    Instruction *instr = &code[i];
+    if (instr->removed) continue;
+
+    if (instr->fused) {
+      memcpy(&chunk->code[instr->newOffset + 1], instr->operands,
+             instr->length - 1);
+      for (int b = 0; b < instr->length; b++) {
+        chunk->lines[instr->newOffset + b] = instr->line;
+      }
+    } else {
+      // lines are moved per byte, some ops report errors at an operand
+      memmove(&chunk->code[instr->newOffset], &chunk->code[instr->offset],
+              instr->length);
+      memmove(&chunk->lines[instr->newOffset], &chunk->lines[instr->offset],
+              instr->length * sizeof(int));
+    }
+
+    chunk->code[instr->newOffset] = instr->op;
+    if (instr->target == -1) continue;
+
+    // jump offset is always the last operand
+    int from = instr->newOffset + instr->length;
+    int to = code[resolve(code, count, instr->target)].newOffset;
+    if (isUnconditional(instr->op)) {
+      chunk->code[instr->newOffset] = to >= from ? OP_JUMP : OP_LOOP;
+    }
+    writeShort(chunk, from - 2, to >= from ? to - from : from - to);
+  }
+
+  chunk->count = offset;
+}
+
+void optimizeChunk(Chunk *chunk) {
+  int length = chunk->count;
+  if (length == 0) return;
+
+  Instruction *code = ALLOCATE(Instruction, length);
+  int *indexAt = ALLOCATE(int, length);
+  int count = 0;
+
+  for (int offset = 0; offset < length; offset++) indexAt[offset] = -1;
+
+  for (int offset = 0; offset < length;) {
+    Instruction *instr = &code[count];
+    instr->op = chunk->code[offset];
+    instr->offset = offset;
+    instr->length = instructionLength(chunk, offset);
+    instr->line = chunk->lines[offset];
+    instr->target = -1;
+    instr->isTarget = false;
+    instr->removed = false;
+    instr->fused = false;
+
+    indexAt[offset] = count++;
+    offset += instr->length;
+  }
+
+  // jump targets as instruction indexes
+  bool valid = true;
+  for (int i = 0; i < count && valid; i++) {
+    if (!isJump(code[i].op)) continue;
+
+    // jump offset is always the last operand
+    int from = code[i].offset + code[i].length;
+    int operand = (chunk->code[from - 2] << 8) | chunk->code[from - 1];
+    int to = isBackward(code[i].op) ? from - operand : from + operand;
+
+    if (to < 0 || to >= length || indexAt[to] == -1) {
+      valid = false;  // leave code we don't understand alone
+    } else {
+      code[i].target = indexAt[to];
+    }
+  }
+
+  if (valid) {
+    while (peephole(code, count)) {
+    }
+    fuse(chunk, code, count);
+    emit(chunk, code, count);
+  }
+
+  FREE_ARRAY(int, indexAt, length);
+  FREE_ARRAY(Instruction, code, length);
+}
+
+// how many values instruction at offset leaves on the stack (negative when
+// it takes more than it pushes)
+static int stackEffect(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_SHORT:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_SHORT:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_SHORT:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_SHORT:
+    case OP_GET_CAPTURED:
+    case OP_GET_CAPTURED_SHORT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      return 1;
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSE_UPVALUE:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_POWER:
+    case OP_POP:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_SET_LOCAL_POP:
+      return -1;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -chunk->code[offset + 1];  // arguments, callee becomes result
+    case OP_INVOKE:
+      return -chunk->code[offset + 3];
+    case OP_SUPER_INVOKE:
+      return -chunk->code[offset + 3] - 1;  // superclass too
+    default:
+      return 0;
+  }
+}
+
+int maxStackDepth(Chunk *chunk, int base) {
+  if (chunk->count == 0) return base;
+
+  // depth before each instruction, -1 until some path reaches it.
+  // compiler keeps depth same on all paths, so first one is enough
+  int *depthAt = ALLOCATE(int, chunk->count);
+  int *work = ALLOCATE(int, chunk->count);
+  int workCount = 0;
+  for (int i = 0; i < chunk->count; i++) depthAt[i] = -1;
+
+  int max = base;
+  depthAt[0] = base;
+  work[workCount++] = 0;
+
+  while (workCount > 0) {
+    int offset = work[--workCount];
+
+    // one straight run of code, jump targets are queued
+    for (;;) {
+      uint8_t op = chunk->code[offset];
+      int length = instructionLength(chunk, offset);
+      int depth = depthAt[offset] + stackEffect(chunk, offset);
+      if (depth > max) max = depth;
+
+      if (isJump(op)) {
+        int from = offset + length;
+        int jump = (chunk->code[from - 2] << 8) | chunk->code[from - 1];
+        int target = isBackward(op) ? from - jump : from + jump;
+        if (target >= 0 && target < chunk->count && depthAt[target] == -1) {
+          depthAt[target] = depth;
+          work[workCount++] = target;
+        }
+      }
+
+      int next = offset + length;
+      if (isUnconditional(op) || op == OP_RETURN || next >= chunk->count ||
+          depthAt[next] != -1) {
+        break;
+      }
+      depthAt[next] = depth;
+      offset = next;
+    }
+  }
+
+  FREE_ARRAY(int, work, chunk->count);
+  FREE_ARRAY(int, depthAt, chunk->count);
+  return max;
+}
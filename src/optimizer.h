@@ -0,0 +1,20 @@
+#ifndef iii_optimizer_h
+#define iii_optimizer_h
+
+#include "chunk.h"
+
+// peephole pass over finished chunk (called from endCompiler):
+//  - EQUAL NOT -> NOT_EQUAL, LESS NOT -> GREATER_EQUAL,
+//    GREATER NOT -> LESS_EQUAL
+//  - JUMP_FALSE + POP on both edges -> POP_JUMP_IF_FALSE
+//  - jumps to jumps go straight to the final target
+//  - code that can't be reached is dropped
+//  - hot sequences are fused into superinstructions (OP_ADD_LOCALS, ...)
+// jump offsets and lines are rewritten to match the new code
+void optimizeChunk(Chunk *chunk);
+
+// most values frame of chunk ever has on the stack, base is what is there
+// when it starts (callee and arguments)
+int maxStackDepth(Chunk *chunk, int base);
+
+#endif
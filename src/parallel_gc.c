@@ -0,0 +1,355 @@
+#include "parallel_gc.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "heap.h"
+#include "vm.h"
+
+// items of work-stealing deque, old arrays stay alive until marking ends
+// (thief can still read from one after owner grew it)
+typedef struct DequeArray {
+  long capacity;  // power of 2
+  Obj **items;
+  struct DequeArray *retired;
+} DequeArray;
+
+typedef struct {
+  pthread_t thread;
+
+  // Chase-Lev deque: owner pushes and takes at bottom, others steal at top
+  long top;
+  long bottom;
+  DequeArray *array;
+
+  size_t freed;  // parallel sweep
+} GCWorker;
+
+typedef void (*GCTask)(GCWorker *worker);
+
+static GCWorker *workers = NULL;  // workers[0] is thread that collects
+static int workerCount = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static GCTask task = NULL;
+static int generation = 0;  // bumped for every task
+static int running = 0;     // workers still running the task
+static bool stopping = false;
+
+static int idleCount = 0;  // marking threads that found no work
+
+static int nextSegment = 0;  // next object segment of parallel sweep
+static bool sweepingYoung = false;  // young segments instead of all
+
+// worker of the current thread while it runs a task
+static __thread GCWorker *currentWorker = NULL;
+
+static void *grow(void *pointer, size_t size) {
+  void *res = realloc(pointer, size);
+  if (res == NULL) {
+    perror("Parallel GC problem (FATAL)\n");
+    exit(1);
+  }
+  return res;
+}
+
+static DequeArray *newDequeArray(long capacity) {
+  DequeArray *array = grow(NULL, sizeof(DequeArray));
+  array->capacity = capacity;
+  array->items = grow(NULL, sizeof(Obj *) * capacity);
+  array->retired = NULL;
+  return array;
+}
+
+static void freeDequeArrays(DequeArray *array) {
+  while (array != NULL) {
+    DequeArray *retired = array->retired;
+    free(array->items);
+    free(array);
+    array = retired;
+  }
+}
+
+static void dequePush(GCWorker *worker, Obj *obj) {
+  long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+  DequeArray *array = worker->array;
+
+  if (bottom - top > array->capacity - 1) {
+    DequeArray *bigger = newDequeArray(array->capacity * 2);
+    for (long i = top; i < bottom; i++) {
+      bigger->items[i & (bigger->capacity - 1)] =
+          array->items[i & (array->capacity - 1)];
+    }
+    bigger->retired = array;
+    __atomic_store_n(&worker->array, bigger, __ATOMIC_RELEASE);
+    array = bigger;
+  }
+
+  __atomic_store_n(&array->items[bottom & (array->capacity - 1)], obj,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+static Obj *dequeTake(GCWorker *worker) {
+  long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+  DequeArray *array = worker->array;
+  __atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {  // empty
+    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  Obj *obj = __atomic_load_n(&array->items[bottom & (array->capacity - 1)],
+                             __ATOMIC_RELAXED);
+  if (top == bottom) {
+    // last item, thieves can want it too
+    if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      obj = NULL;
+    }
+    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return obj;
+}
+
+// NULL when deque is empty or other thread was faster
+static Obj *dequeSteal(GCWorker *worker) {
+  long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) return NULL;
+
+  DequeArray *array = __atomic_load_n(&worker->array, __ATOMIC_ACQUIRE);
+  Obj *obj = __atomic_load_n(&array->items[top & (array->capacity - 1)],
+                             __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return obj;
+}
+
+static bool dequeEmpty(GCWorker *worker) {
+  return __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE) >=
+         __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+}
+
+static void runTask(GCWorker *worker) {
+  currentWorker = worker;
+  task(worker);
+  currentWorker = NULL;
+}
+
+static void *workerLoop(void *arg) {
+  GCWorker *worker = (GCWorker *)arg;
+  int seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    while (generation == seen && !stopping) {
+      pthread_cond_wait(&wake, &lock);
+    }
+    if (stopping) {
+      pthread_mutex_unlock(&lock);
+      return NULL;
+    }
+    seen = generation;
+    pthread_mutex_unlock(&lock);
+
+    runTask(worker);
+
+    pthread_mutex_lock(&lock);
+    if (--running == 0) pthread_cond_signal(&done);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static void startGCThreads() {
+  workerCount = vm.gcThreads;
+  workers = grow(NULL, sizeof(GCWorker) * workerCount);
+  for (int i = 0; i < workerCount; i++) {
+    workers[i].top = 0;
+    workers[i].bottom = 0;
+    workers[i].array = newDequeArray(256);
+  }
+
+  for (int i = 1; i < workerCount; i++) {
+    if (pthread_create(&workers[i].thread, NULL, workerLoop, &workers[i]) !=
+        0) {
+      perror("Can't start GC thread (FATAL)\n");
+      exit(1);
+    }
+  }
+}
+
+void stopGCThreads() {
+  if (workers == NULL) return;
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 1; i < workerCount; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  for (int i = 0; i < workerCount; i++) {
+    freeDequeArrays(workers[i].array);
+  }
+  free(workers);
+  workers = NULL;
+  workerCount = 0;
+  stopping = false;
+}
+
+// runs task on all workers, returns when every one of them is done
+static void runOnAll(GCTask newTask) {
+  if (workers == NULL) startGCThreads();
+
+  pthread_mutex_lock(&lock);
+  task = newTask;
+  running = workerCount - 1;
+  generation++;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+
+  runTask(&workers[0]);
+
+  pthread_mutex_lock(&lock);
+  while (running > 0) pthread_cond_wait(&done, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+static Obj *stealFromOthers(GCWorker *self) {
+  for (int i = 0; i < workerCount; i++) {
+    if (&workers[i] == self) continue;
+    Obj *obj = dequeSteal(&workers[i]);
+    if (obj != NULL) return obj;
+  }
+  return NULL;
+}
+
+static bool othersHaveWork(GCWorker *self) {
+  for (int i = 0; i < workerCount; i++) {
+    if (&workers[i] != self && !dequeEmpty(&workers[i])) return true;
+  }
+  return false;
+}
+
+static void markTask(GCWorker *self) {
+  for (;;) {
+    Obj *obj;
+    while ((obj = dequeTake(self)) != NULL) blackenObject(obj);
+
+    obj = stealFromOthers(self);
+    if (obj != NULL) {
+      blackenObject(obj);
+      continue;
+    }
+
+    // nothing to do, marking is over when every thread gets here (idle
+    // thread can't make new work)
+    __atomic_add_fetch(&idleCount, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&idleCount, __ATOMIC_SEQ_CST) == workerCount) {
+        return;
+      }
+      if (othersHaveWork(self)) {
+        __atomic_sub_fetch(&idleCount, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+void parallelTrackReferences() {
+  if (workers == NULL) startGCThreads();
+
+  // gray objects marked so far are dealt out to all deques
+  for (int i = 0; i < vm.grayCount; i++) {
+    dequePush(&workers[i % workerCount], vm.grayStack[i]);
+  }
+  vm.grayCount = 0;
+  idleCount = 0;
+
+  runOnAll(markTask);
+
+  for (int i = 0; i < workerCount; i++) {
+    freeDequeArrays(workers[i].array->retired);
+    workers[i].array->retired = NULL;
+  }
+}
+
+bool parallelMarkObject(Obj *obj) {
+  GCWorker *worker = currentWorker;
+  if (worker == NULL) return false;
+
+  size_t bit = SEGMENT_BIT(obj);
+  uint64_t *word = &SEGMENT_OF(obj)->marks[bit / 64];
+  uint64_t mask = (uint64_t)1 << (bit % 64);
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) return true;
+  if (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask) {
+    return true;  // other thread was faster
+  }
+
+  obj->isRemembered = true;  // gray until blackened
+  dequePush(worker, obj);
+  return true;
+}
+
+static void sweepTask(GCWorker *self) {
+  self->freed = 0;
+
+  for (;;) {
+    int index = __atomic_fetch_add(&nextSegment, 1, __ATOMIC_RELAXED);
+    if (sweepingYoung) {
+      if (index >= youngSegmentCount()) return;
+      self->freed += sweepSegment(youngSegment(index));
+      continue;
+    }
+
+    if (index >= objectSegmentCount()) return;
+    Segment *segment = objectSegment(index);
+    if (!isSwept(segment)) self->freed += sweepSegment(segment);
+  }
+}
+
+bool parallelFree(void *pointer, size_t size) {
+  GCWorker *worker = currentWorker;
+  if (worker == NULL) return false;
+
+  worker->freed += size;
+  free(pointer);
+  return true;
+}
+
+bool parallelFreeCell(void *cell, int sizeClass) {
+  GCWorker *worker = currentWorker;
+  if (worker == NULL) return false;
+
+  // other threads can free cells of the same segment
+  heapFreeCellAtomic(cell);
+  worker->freed += CELL_SIZE(sizeClass);
+  return true;
+}
+
+void parallelSweep(bool young) {
+  nextSegment = 0;
+  sweepingYoung = young;
+  runOnAll(sweepTask);
+
+  for (int i = 0; i < workerCount; i++) {
+    vm.bytesAllocated -= workers[i].freed;
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef iii_parallel_gc_h
+#define iii_parallel_gc_h
+
+#include "common.h"
+#include "object.h"
+
+// Stop-the-world parts of collection can run on vm.gcThreads threads (the
+// calling one is one of them). Threads are started on first use and wait
+// for work between collections.
+//  - marking: every thread blackens gray objects from its own deque and
+//    steals from others when it runs out, mark bit is set atomically
+//  - sweeping: threads take object segments one by one and sweep them,
+//    cells of chars they free are cleared atomically
+// mutator is stopped all the time, so nothing else needs to be atomic
+
+// blackens everything reachable from vm.grayStack (empties it)
+void parallelTrackReferences();
+
+// sweeps every object segment that isn't swept yet, or just young
+// segments (see heap.h)
+void parallelSweep(bool young);
+
+// markObject on a marking thread, false when not on one
+bool parallelMarkObject(Obj *obj);
+
+// frees of sweeping thread (counted and given back by parallelSweep),
+// false when not on one
+bool parallelFree(void *pointer, size_t size);
+bool parallelFreeCell(void *cell, int sizeClass);
+
+void stopGCThreads();
+
+#endif
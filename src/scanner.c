@@ -5,13 +5,6 @@
 
 #include "common.h"
 
-typedef struct {
-  const char *start;
-  const char *current;
-
-  int line;
-} Scanner;
-
 Scanner scanner;
 
 void initScanner(const char *source) {
@@ -20,6 +13,10 @@ void initScanner(const char *source) {
   scanner.line = 1;
 }
 
+Scanner saveScanner() { return scanner; }
+
+void restoreScanner(Scanner saved) { scanner = saved; }
+
 static bool isAtEnd() { return *scanner.current == '\0'; }
 
 static Token makeToken(TokenType type) {
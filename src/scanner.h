@@ -56,7 +56,18 @@ typedef struct {
   int line;
 } Token;
 
+typedef struct {
+  const char *start;
+  const char *current;
+
+  int line;
+} Scanner;
+
 void initScanner(const char *source);
 Token scanToken();
 
+// scanner position, lets the parser look at tokens ahead and come back
+Scanner saveScanner();
+void restoreScanner(Scanner saved);
+
 #endif
@@ -28,25 +28,27 @@ void freeValueArray(ValueArray *array) {
 }
 
 void printValue(Value value) {
-  switch (value.type) {
-    case VAL_OBJ:
-      printObject(value);
-      break;
-    case VAL_NIL:
-      printf("nil");
-      break;
-    case VAL_NUM:
-      printf("%g", AS_NUM(value));
-      break;
-    case VAL_BOOL:
-      printf(AS_BOOL(value) ? "true" : "false");
-      break;
-    default:
-      printf("Unknown value type\n");
+  if (IS_OBJ(value)) {
+    printObject(value);
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUM(value));
+  } else if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else {
+    printf("Unknown value type\n");
   }
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // numbers still compare as doubles so NaN != NaN
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUM(a) == AS_NUM(b);
+  }
+  return a == b;
+#else
   if (a.type != b.type) return false;
   switch (a.type) {
     case VAL_BOOL:
@@ -60,4 +62,5 @@ bool valuesEqual(Value a, Value b) {
     default:
       return false;  // unreachable
   }
+#endif
 }
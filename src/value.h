@@ -1,16 +1,73 @@
 #ifndef iii_value_h
 #define iii_value_h
 
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// Every value is a single 64 bit word. Numbers are stored as plain doubles,
+// everything else lives inside quiet NaNs that real arithmetic never produces:
+//  nil/false/true - QNAN with a small tag in the lowest bits
+//  objects        - QNAN with sign bit set and the pointer in the low 48 bits
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1    // 01
+#define TAG_FALSE 2  // 10
+#define TAG_TRUE 3   // 11
+
+// tag 0 is never produced by scripts, it marks global slots that were
+// resolved by the compiler but not defined yet
+#define TAG_UNDEFINED 0
+
+typedef uint64_t Value;
+
+// Macro stuff
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUM_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUM(value) valueToNum(value)
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+// memcpy is the portable way to type-pun, compilers turn it into a move
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUM,
   VAL_OBJ,
+  VAL_UNDEFINED,  // global slot that isn't defined yet (never on stack)
 } ValueType;
 
 typedef struct {
@@ -25,6 +82,7 @@ typedef struct {
 // Macro stuff
 #define BOOL_VAL(val) ((Value){VAL_BOOL, {.boolean = val}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUM_VAL(val) ((Value){VAL_NUM, {.number = val}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
@@ -34,9 +92,12 @@ typedef struct {
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUM)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
+#endif
+
 typedef struct {
   int capacity;
   int count;
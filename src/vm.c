@@ -8,10 +8,12 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "compact.h"
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "parallel_gc.h"
 #include "string.h"
 #include "table.h"
 #include "time.h"
@@ -56,9 +58,68 @@ static Value exitNative(int argCount, Value* args) {
   return NIL_VAL;
 }
 
+// full collection that also moves objects out of sparse segments
+static Value gcCompactNative(int argCount, Value *args) {
+  compactHeap();
+  return NIL_VAL;
+}
+
+// field of instance on top of the stack
+static void setStat(const char *name, double value) {
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  instanceSetField(AS_INSTANCE(vm.stackTop[-2]), AS_STRING(vm.stackTop[-1]),
+                   NUM_VAL(value));
+  pop();
+}
+
+// instance with counters of the collector (see GCStats), times are in
+// milliseconds. objects in heap are the ones that survived last collection
+// and the ones allocated since (cells only, not memory they own)
+static Value gcStatsNative(int argCount, Value *args) {
+  GCStats *stats = &vm.gcStats;
+
+  // counted before the stats instance adds objects of its own
+  int counts[OBJ_TYPE_COUNT];
+  size_t bytes[OBJ_TYPE_COUNT];
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    counts[type] = liveObjects(type, &bytes[type]);
+  }
+
+  push(OBJ_VAL(copyString("GCStats", 7)));
+  ObjClass *cclass = newClass(AS_STRING(vm.stackTop[-1]));
+  vm.stackTop[-1] = OBJ_VAL(cclass);
+  push(OBJ_VAL(newInstance(cclass)));
+
+  setStat("collections", stats->cycles);
+  setStat("minorCollections", stats->minorCollections);
+  setStat("totalPause", stats->totalPause * 1000);
+  setStat("maxPause", stats->maxPause * 1000);
+  setStat("heapBytes", (double)vm.bytesAllocated);
+  setStat("totalAllocated", (double)stats->totalAllocated);
+  setStat("totalFreed", (double)stats->totalFreed);
+  setStat("lastFreed", (double)stats->lastFreed);
+  setStat("allocationRate", stats->allocationRate);
+
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    char name[32];
+    snprintf(name, sizeof(name), "%sCount", objTypeNames[type]);
+    setStat(name, counts[type]);
+    snprintf(name, sizeof(name), "%sBytes", objTypeNames[type]);
+    setStat(name, (double)bytes[type]);
+  }
+
+  Value result = pop();
+  pop();  // class
+  return result;
+}
+
 static void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    vm.openUpvalueSlots[upvalue->location - vm.stack] = NULL;
+  }
   vm.openUpvalues = NULL;
 }
 
@@ -74,6 +135,9 @@ Value pop() {
 
 static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
 
+// stack trace shows this many frames from both ends of the stack
+#define TRACE_FRAMES 10
+
 static void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -81,6 +145,11 @@ static void runtimeError(const char *format, ...) {
   va_end(args);
   fputs("\n", stderr);
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    // deep recursion prints only innermost and outermost frames
+    if (i == vm.frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES) {
+      fprintf(stderr, "... %d more frames ...\n", i - TRACE_FRAMES + 1);
+      i = TRACE_FRAMES - 1;
+    }
     CallFrame *frame = &vm.frames[i];
     ObjFunc *function = frame->closure->function;
     // -1 because the IP is sitting on the next instruction to be executed.
@@ -95,53 +164,196 @@ static void runtimeError(const char *format, ...) {
   resetStack();
 }
 
+int globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUM(slot);
+
+  push(OBJ_VAL(name));  // keep name alive while arrays grow
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globalSlots, name, NUM_VAL((double)index));
+  pop();
+
+  return index;
+}
+
 static void defineNative(const char *name, NativeFn function) {
   // pushing and popping to ensure that the function is not collected by the GC
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
   pop();
   pop();
 }
 
 void initVM() {
+  vm.stackCapacity = STACK_INITIAL;
+  vm.stack = malloc(sizeof(Value) * vm.stackCapacity);
+  vm.openUpvalueSlots = calloc(vm.stackCapacity, sizeof(ObjUpvalue *));
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.frames = malloc(sizeof(CallFrame) * vm.frameCapacity);
+  if (vm.stack == NULL || vm.openUpvalueSlots == NULL || vm.frames == NULL) {
+    perror("Can't allocate vm stack (FATAL)\n");
+    exit(1);
+  }
+
   resetStack();
-  vm.objects = NULL;
   initTable(&vm.strings);
-  initTable(&vm.globals);
-
-  vm.initString = NULL;  // just to be safe from GC
-  vm.initString = copyString(INIT_STRING, INIT_STRING_LEN);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
 
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+
   vm.bytesAllocated = 0;
   vm.nextGC = GC_BEFORE_FIRST;
+  vm.youngBytes = 0;
+
+  vm.gcGrowth = GC_HEAP_GROW_FACTOR;
+  vm.gcMinHeap = GC_BEFORE_FIRST;
+  vm.gcSoftLimit = 0;
+  vm.gcHardLimit = 0;
+  vm.outOfMemory = false;
+
+  vm.gcPhase = GC_IDLE;
+  vm.gcCursor = 0;
+  vm.nextStep = 0;
+  vm.gcMaxPause = GC_MAX_PAUSE / 1000000.0;
+  vm.gcThreads = 1;
+  vm.gcCompact = false;
+  vm.compactPending = false;
+  memset(&vm.gcStats, 0, sizeof(GCStats));
+  memset(vm.boundMethods, 0, sizeof(vm.boundMethods));
+
+  vm.initString = NULL;  // just to be safe from GC
+  vm.initString = copyString(INIT_STRING, INIT_STRING_LEN);
 
   // -----------------------------------
   defineNative("clock", clockNative);
   defineNative("print", printNative);
   defineNative("len", lenNative);
   defineNative("exit", exitNative);
+  defineNative("gcCompact", gcCompactNative);
+  defineNative("gcStats", gcStatsNative);
 }
 
+#ifdef DEBUG_INLINE_CACHES
+static void dumpFunctionCaches(Obj *obj) {
+  ObjFunc *function = (ObjFunc *)obj;
+  dumpInlineCaches(&function->chunk, function->name != NULL
+                                         ? function->name->chars
+                                         : "<script>");
+}
+#endif
+
 void freeVM() {
+#ifdef DEBUG_INLINE_CACHES
+  forEachObject(OBJ_FUNCTION, dumpFunctionCaches);
+#endif
+#ifdef DEBUG_PROFILE_OPCODES
+  dumpOpcodeProfile();
+#endif
+  stopGCThreads();
   freeObjects();  // free all objects
   freeTable(&vm.strings);
-  freeTable(&vm.globals);
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
   vm.initString = NULL;
+
+  free(vm.stack);
+  free(vm.openUpvalueSlots);
+  free(vm.frames);
+  vm.stack = NULL;
+  vm.openUpvalueSlots = NULL;
+  vm.frames = NULL;
+}
+
+// stack moves to new memory, pointers into it are moved with it
+static bool growStack(int needed) {
+  if (needed > STACK_MAX) return false;
+
+  int capacity = vm.stackCapacity;
+  while (capacity < needed) capacity *= 2;
+  if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+  Value *stack = malloc(sizeof(Value) * capacity);
+  ObjUpvalue **slots = realloc(vm.openUpvalueSlots,
+                               sizeof(ObjUpvalue *) * capacity);
+  if (stack == NULL || slots == NULL) {
+    perror("Can't grow vm stack (FATAL)\n");
+    exit(1);
+  }
+  memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm.stack);
+  }
+  vm.stackTop = stack + (vm.stackTop - vm.stack);
+  memset(slots + vm.stackCapacity, 0,
+         sizeof(ObjUpvalue *) * (capacity - vm.stackCapacity));
+
+  free(vm.stack);
+  vm.stack = stack;
+  vm.openUpvalueSlots = slots;
+  vm.stackCapacity = capacity;
+  return true;
+}
+
+// frame starting at slots has room for everything function pushes
+static bool ensureStack(Value *slots, ObjFunc *function) {
+  int needed = (int)(slots - vm.stack) + function->maxStack + STACK_SLACK;
+  return needed <= vm.stackCapacity || growStack(needed);
+}
+
+static bool growFrames() {
+  if (vm.frameCapacity >= FRAMES_MAX) return false;
+
+  int capacity = vm.frameCapacity * 2;
+  if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+
+  CallFrame *frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+  if (frames == NULL) {
+    perror("Can't grow vm frames (FATAL)\n");
+    exit(1);
+  }
+  vm.frames = frames;
+  vm.frameCapacity = capacity;
+  return true;
+}
+
+// heap is over vm.gcHardLimit even after full collection (see allocated)
+static void outOfMemoryError() {
+  vm.outOfMemory = false;
+  runtimeError("Out of memory (heap limit is %zu bytes)", vm.gcHardLimit);
 }
 
 static bool call(ObjClosure *closure, int argCount) {
+  if (vm.outOfMemory) {
+    outOfMemoryError();
+    return false;
+  }
+
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d", closure->function->arity,
                  argCount);
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if ((vm.frameCount == vm.frameCapacity && !growFrames()) ||
+      !ensureStack(vm.stackTop - argCount - 1, closure->function)) {
     runtimeError("Stack overflow");
     return false;
   }
@@ -192,33 +404,22 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static bool invokeFromClass(ObjClass *cclass, ObjString *name, int argCount) {
-  Value method;
-  if (!tableGet(&cclass->methods, name, &method)) {
-    runtimeError("Undefined property '%s'", name->chars);
-    return false;
+// `var f = obj.method` in a loop doesn't allocate a new bound method every
+// time, bound method is immutable so the same one can be given out again.
+// receiver is always an instance (this)
+static ObjBoundMethod *bindCached(Value receiver, ObjClosure *method) {
+  uintptr_t hash = ((uintptr_t)AS_OBJ(receiver) ^ (uintptr_t)method) >> 4;
+  ObjBoundMethod **slot = &vm.boundMethods[hash & (BOUND_CACHE_SIZE - 1)];
+
+  ObjBoundMethod *bound = *slot;
+  if (bound != NULL && bound->method == method &&
+      AS_OBJ(bound->receiver) == AS_OBJ(receiver)) {
+    return bound;
   }
 
-  return call(AS_CLOSURE(method), argCount);
-}
-
-static bool invoke(ObjString *name, int argCount) {
-  Value receiver = peek(argCount);
-
-  if (!IS_INSTANCE(receiver)) {
-    runtimeError("Only instances have methods");
-    return false;
-  }
-
-  ObjInstance *instance = AS_INSTANCE(receiver);
-
-  Value val;
-  if (tableGet(&instance->fields, name, &val)) {
-    vm.stackTop[-argCount - 1] = val;
-    return callValue(val, argCount);
-  }
-
-  return invokeFromClass(instance->cclass, name, argCount);
+  bound = newBoundMethod(receiver, method);
+  *slot = bound;
+  return bound;
 }
 
 static bool bindMethod(ObjClass *cclass, ObjString *name) {
@@ -228,7 +429,7 @@ static bool bindMethod(ObjClass *cclass, ObjString *name) {
     return false;
   }
 
-  ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+  ObjBoundMethod *bound = bindCached(peek(0), AS_CLOSURE(method));
 
   pop();
   push(OBJ_VAL(bound));
@@ -236,20 +437,20 @@ static bool bindMethod(ObjClass *cclass, ObjString *name) {
 }
 
 static ObjUpvalue *captureUpvalue(Value *local) {
+  ObjUpvalue **slot = &vm.openUpvalueSlots[local - vm.stack];
+  if (*slot != NULL) return *slot;
+
+  ObjUpvalue *createdUpvalue = newUpvalue(local);
+  *slot = createdUpvalue;
+
+  // usually captured locals are in the newest frame, near the head
   ObjUpvalue *prevUpvalue = NULL;
   ObjUpvalue *upvalue = vm.openUpvalues;
-
-  // all this can be a little bit slow, but should be ok
   while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
     upvalue = upvalue->next;
   }
-
-  if (upvalue != NULL && upvalue->location == local) {
-    return upvalue;
-  }
-
-  ObjUpvalue *createdUpvalue = newUpvalue(local);
+  createdUpvalue->next = upvalue;
 
   if (prevUpvalue == NULL) {
     vm.openUpvalues = createdUpvalue;
@@ -263,8 +464,10 @@ static ObjUpvalue *captureUpvalue(Value *local) {
 static void closeUpvalues(Value *last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
+    vm.openUpvalueSlots[upvalue->location - vm.stack] = NULL;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    writeBarrier((Obj *)upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
@@ -273,11 +476,231 @@ static void defineMethod(ObjString *name) {
   Value method = peek(0);
   ObjClass *cclass = AS_CLASS(peek(1));
   tableSet(&cclass->methods, name, method);
+  writeBarrierObj((Obj *)cclass, (Obj *)name);
+  writeBarrier((Obj *)cclass, method);
+  cclass->version++;
   pop();
 }
 
+static inline InlineCacheEntry *cacheLookup(InlineCache *cache, void *key) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].key == key) return &cache->entries[i];
+  }
+  return NULL;
+}
+
+// returns entry for key that should be filled by caller,
+// NULL when cache is megamorphic (or key can't be cached)
+static InlineCacheEntry *cacheInsert(InlineCache *cache, void *key) {
+  if (key == NULL || cache->state == IC_MEGAMORPHIC) return NULL;
+
+  // entry for this key can exist if it went stale (methods changed)
+  InlineCacheEntry *entry = cacheLookup(cache, key);
+  if (entry != NULL) return entry;
+
+  if (cache->count == IC_POLYMORPHIC_MAX) {
+    cache->state = IC_MEGAMORPHIC;
+    cache->count = 0;
+    return NULL;
+  }
+
+  entry = &cache->entries[cache->count++];
+  cache->state = cache->count == 1 ? IC_MONOMORPHIC : IC_POLYMORPHIC;
+
+  // caller fills entry with objects that can be young, cache belongs to
+  // function running in the top frame
+  rememberObject((Obj *)vm.frames[vm.frameCount - 1].closure->function);
+
+  entry->key = key;
+  entry->transition = NULL;
+  entry->method = NULL;
+  entry->version = 0;
+  entry->slot = -1;
+  return entry;
+}
+
+// OP_GET_PROPERTY, receiver is on top of the stack
+static bool getProperty(ObjString *name, InlineCache *cache) {
+  ObjInstance *instance = AS_INSTANCE(peek(0));
+  ObjShape *shape = instance->shape;
+
+  InlineCacheEntry *entry = cacheLookup(cache, shape);
+  if (entry != NULL) {
+    if (entry->method == NULL) {
+      cache->hits++;
+      vm.stackTop[-1] = instance->fields[entry->slot];
+      return true;
+    }
+
+    if (entry->version == instance->cclass->version) {
+      cache->hits++;
+      ObjBoundMethod *bound = bindCached(peek(0), entry->method);
+      vm.stackTop[-1] = OBJ_VAL(bound);
+      return true;
+    }
+  }
+
+  cache->misses++;
+
+  Value val;
+  if (instanceGetField(instance, name, &val)) {
+    entry = cacheInsert(cache, shape);
+    if (entry != NULL) {
+      entry->slot = shapeSlot(shape, name);
+      entry->method = NULL;
+    }
+
+    vm.stackTop[-1] = val;
+    return true;
+  }
+
+  Value method;
+  if (!tableGet(&instance->cclass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'", name->chars);
+    return false;
+  }
+
+  entry = cacheInsert(cache, shape);
+  if (entry != NULL) {
+    entry->method = AS_CLOSURE(method);
+    entry->version = instance->cclass->version;
+  }
+
+  ObjBoundMethod *bound = bindCached(peek(0), AS_CLOSURE(method));
+  vm.stackTop[-1] = OBJ_VAL(bound);
+  return true;
+}
+
+// OP_SET_PROPERTY, value is on top of the stack and receiver under it
+static void setProperty(ObjString *name, InlineCache *cache) {
+  ObjInstance *instance = AS_INSTANCE(peek(1));
+  ObjShape *shape = instance->shape;
+
+  InlineCacheEntry *entry = cacheLookup(cache, shape);
+  if (entry != NULL) {
+    cache->hits++;
+    if (entry->transition == NULL) {
+      instance->fields[entry->slot] = peek(0);
+      writeBarrier((Obj *)instance, peek(0));
+    } else {
+      instanceAddField(instance, entry->transition, peek(0));
+    }
+    return;
+  }
+
+  cache->misses++;
+
+  int slot = shape == NULL ? -1 : shapeSlot(shape, name);
+  if (slot != -1) {
+    instance->fields[slot] = peek(0);
+    writeBarrier((Obj *)instance, peek(0));
+    entry = cacheInsert(cache, shape);
+    if (entry != NULL) entry->slot = slot;
+    return;
+  }
+
+  instanceSetField(instance, name, peek(0));
+
+  // field was added, remember transition if instance still uses shapes
+  if (instance->shape != NULL && instance->shape->parent == shape) {
+    entry = cacheInsert(cache, shape);
+    if (entry != NULL) {
+      entry->transition = instance->shape;
+      entry->slot = instance->shape->fieldCount - 1;
+    }
+  }
+}
+
+// OP_INVOKE, receiver is under the arguments. Cache is keyed by shape so
+// adding a field that shadows the method changes the key
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
+  Value receiver = peek(argCount);
+
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have methods");
+    return false;
+  }
+
+  ObjInstance *instance = AS_INSTANCE(receiver);
+  ObjShape *shape = instance->shape;
+
+  InlineCacheEntry *entry = cacheLookup(cache, shape);
+  if (entry != NULL) {
+    if (entry->method == NULL) {
+      cache->hits++;
+      Value val = instance->fields[entry->slot];
+      vm.stackTop[-argCount - 1] = val;
+      return callValue(val, argCount);
+    }
+
+    if (entry->version == instance->cclass->version) {
+      cache->hits++;
+      return call(entry->method, argCount);
+    }
+  }
+
+  cache->misses++;
+
+  Value val;
+  if (instanceGetField(instance, name, &val)) {
+    entry = cacheInsert(cache, shape);
+    if (entry != NULL) {
+      entry->slot = shapeSlot(shape, name);
+      entry->method = NULL;
+    }
+
+    vm.stackTop[-argCount - 1] = val;
+    return callValue(val, argCount);
+  }
+
+  Value method;
+  if (!tableGet(&instance->cclass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'", name->chars);
+    return false;
+  }
+
+  entry = cacheInsert(cache, shape);
+  if (entry != NULL) {
+    entry->method = AS_CLOSURE(method);
+    entry->version = instance->cclass->version;
+  }
+
+  return call(AS_CLOSURE(method), argCount);
+}
+
+// OP_SUPER_INVOKE, superclass of a site changes only when class declaration
+// is executed again
+static bool superInvoke(ObjClass *superclass, ObjString *name, int argCount,
+                        InlineCache *cache) {
+  InlineCacheEntry *entry = cacheLookup(cache, superclass);
+  if (entry != NULL && entry->version == superclass->version) {
+    cache->hits++;
+    return call(entry->method, argCount);
+  }
+
+  cache->misses++;
+
+  Value method;
+  if (!tableGet(&superclass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'", name->chars);
+    return false;
+  }
+
+  entry = cacheInsert(cache, superclass);
+  if (entry != NULL) {
+    entry->method = AS_CLOSURE(method);
+    entry->version = superclass->version;
+  }
+
+  return call(AS_CLOSURE(method), argCount);
+}
+
 static bool isFalsey(Value value) {
+#ifdef NAN_BOXING
+  return value == NIL_VAL || value == FALSE_VAL;
+#else
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+#endif
 }
 
 static void concatenate() {
@@ -285,7 +708,7 @@ static void concatenate() {
   ObjString *a = AS_STRING(peek(1));
   int length = a->length + b->length;
 
-  char *chars = ALLOCATE(char, length + 1);
+  char *chars = ALLOCATE_CELL(char, length + 1);
   memcpy(chars, a->chars, a->length);
   memcpy(chars + a->length, b->chars, b->length);
   chars[length] = '\0';
@@ -304,296 +727,704 @@ static void undefinedVarError(ObjString *name) {
 static InterpretResult run() {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT_LONG()                 \
-  (frame->closure->function->chunk.constants \
-       .values[(READ_BYTE() << 8) | READ_BYTE()])
+  // hot frame state is kept in locals instead of being re-read through
+  // frame-> on every instruction, ip is written back to the frame before
+  // anything that can push a frame or report a runtime error
+  register uint8_t *ip = frame->ip;
+  register Value *slots = frame->slots;
+  register Value *constants = frame->closure->function->chunk.constants.values;
+  InlineCache *caches = frame->closure->function->chunk.caches;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT_LONG() (constants[READ_SHORT()])
 #define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
-#define BINARY_OP(valType, op)                        \
+#define READ_CACHE() (&caches[READ_SHORT()])
+#define STORE_FRAME() (frame->ip = ip)
+// objects can move here (see compact.h), locals point only to arrays that
+// stay where they are. heap over its hard limit is reported here too
+#define SAFE_POINT()                      \
+  do {                                    \
+    if (vm.compactPending) compactHeap(); \
+    if (vm.outOfMemory) {                 \
+      STORE_FRAME();                      \
+      outOfMemoryError();                 \
+      return INTERPRET_RUNTIME_ERROR;     \
+    }                                     \
+  } while (false)
+#define LOAD_FRAME()                                               \
+  do {                                                             \
+    frame = &vm.frames[vm.frameCount - 1];                         \
+    ip = frame->ip;                                                \
+    slots = frame->slots;                                          \
+    constants = frame->closure->function->chunk.constants.values; \
+    caches = frame->closure->function->chunk.caches;              \
+  } while (false)
+#define RUNTIME_ERROR(...)          \
+  do {                              \
+    STORE_FRAME();                  \
+    runtimeError(__VA_ARGS__);      \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+// instruction that is running is rewritten in place (see quickened ops)
+#define QUICKEN(op) (ip[-1] = (op))
+// quickened instruction saw wrong types, rewrite it back to generic op and
+// step back so the next dispatch runs generic op instead
+#define DEOPTIMIZE(op) (ip--, *ip = (op))
+#define BINARY_OP(valType, op, quickOp)               \
   do {                                                \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers");       \
-      return INTERPRET_RUNTIME_ERROR;                 \
+      RUNTIME_ERROR("Operands must be numbers");      \
     }                                                 \
+    QUICKEN(quickOp);                                 \
     double b = AS_NUM(pop());                         \
     double a = AS_NUM(pop());                         \
     push(valType(a op b));                            \
   } while (false)
+#define BINARY_OP_NUM(valType, op, genericOp)          \
+  do {                                                 \
+    Value b = peek(0);                                 \
+    Value a = peek(1);                                 \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {              \
+      DEOPTIMIZE(genericOp);                           \
+      break;                                           \
+    }                                                  \
+    vm.stackTop[-2] = valType(AS_NUM(a) op AS_NUM(b)); \
+    vm.stackTop--;                                     \
+  } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION  // enable debug trace if macro is defined
-    printf("\nrunning... \n");
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                                \
+  do {                                                                     \
+    printf("\nrunning... \n");                                             \
+    printf("          ");                                                  \
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {             \
+      printf("[ ");                                                        \
+      printValue(*slot);                                                   \
+      printf(" ]");                                                        \
+    }                                                                      \
+    printf("\n");                                                          \
+    disassembleInstruction(&frame->closure->function->chunk,               \
+                           (int)(ip - frame->closure->function->chunk.code)); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+  do {                      \
+  } while (false)
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(*ip)
+#else
+#define PROFILE_INSTRUCTION() \
+  do {                        \
+  } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+  // every handler jumps to the next one on its own, so each opcode gets its
+  // own indirect branch (and its own slot in the branch predictor)
+  static void *dispatchTable[] = {
+      [OP_CONSTANT] = &&do_OP_CONSTANT,
+      [OP_CONSTANT_SHORT] = &&do_OP_CONSTANT_SHORT,
+      [OP_DEFINE_GLOBAL] = &&do_OP_DEFINE_GLOBAL,
+      [OP_GET_GLOBAL] = &&do_OP_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&do_OP_SET_GLOBAL,
+      [OP_GET_GLOBAL_SHORT] = &&do_OP_GET_GLOBAL_SHORT,
+      [OP_SET_GLOBAL_SHORT] = &&do_OP_SET_GLOBAL_SHORT,
+      [OP_SET_LOCAL] = &&do_OP_SET_LOCAL,
+      [OP_GET_LOCAL] = &&do_OP_GET_LOCAL,
+      [OP_SET_LOCAL_SHORT] = &&do_OP_SET_LOCAL_SHORT,
+      [OP_GET_LOCAL_SHORT] = &&do_OP_GET_LOCAL_SHORT,
+      [OP_GET_UPVALUE] = &&do_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&do_OP_SET_UPVALUE,
+      [OP_GET_UPVALUE_SHORT] = &&do_OP_GET_UPVALUE_SHORT,
+      [OP_SET_UPVALUE_SHORT] = &&do_OP_SET_UPVALUE_SHORT,
+      [OP_GET_CAPTURED] = &&do_OP_GET_CAPTURED,
+      [OP_GET_CAPTURED_SHORT] = &&do_OP_GET_CAPTURED_SHORT,
+      [OP_CLOSE_UPVALUE] = &&do_OP_CLOSE_UPVALUE,
+      [OP_GET_PROPERTY] = &&do_OP_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&do_OP_SET_PROPERTY,
+      [OP_GET_SUPER] = &&do_OP_GET_SUPER,
+      [OP_NIL] = &&do_OP_NIL,
+      [OP_TRUE] = &&do_OP_TRUE,
+      [OP_FALSE] = &&do_OP_FALSE,
+      [OP_NOT] = &&do_OP_NOT,
+      [OP_EQUAL] = &&do_OP_EQUAL,
+      [OP_GREATER] = &&do_OP_GREATER,
+      [OP_LESS] = &&do_OP_LESS,
+      [OP_NOT_EQUAL] = &&do_OP_NOT_EQUAL,
+      [OP_GREATER_EQUAL] = &&do_OP_GREATER_EQUAL,
+      [OP_LESS_EQUAL] = &&do_OP_LESS_EQUAL,
+      [OP_NEGATE] = &&do_OP_NEGATE,
+      [OP_ADD] = &&do_OP_ADD,
+      [OP_SUBTRACT] = &&do_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&do_OP_MULTIPLY,
+      [OP_DIVIDE] = &&do_OP_DIVIDE,
+      [OP_POWER] = &&do_OP_POWER,
+      [OP_RETURN] = &&do_OP_RETURN,
+      [OP_POP] = &&do_OP_POP,
+      [OP_JUMP_FALSE] = &&do_OP_JUMP_FALSE,
+      [OP_POP_JUMP_IF_FALSE] = &&do_OP_POP_JUMP_IF_FALSE,
+      [OP_JUMP] = &&do_OP_JUMP,
+      [OP_LOOP] = &&do_OP_LOOP,
+      [OP_LOOP_LT] = &&do_OP_LOOP_LT,
+      [OP_FOR_NUM_STEP] = &&do_OP_FOR_NUM_STEP,
+      [OP_CALL] = &&do_OP_CALL,
+      [OP_TAIL_CALL] = &&do_OP_TAIL_CALL,
+      [OP_CLOSURE] = &&do_OP_CLOSURE,
+      [OP_INVOKE] = &&do_OP_INVOKE,
+      [OP_SUPER_INVOKE] = &&do_OP_SUPER_INVOKE,
+      [OP_CLASS] = &&do_OP_CLASS,
+      [OP_METHOD] = &&do_OP_METHOD,
+      [OP_INHERIT] = &&do_OP_INHERIT,
+      [OP_ADD_NUM] = &&do_OP_ADD_NUM,
+      [OP_ADD_STR] = &&do_OP_ADD_STR,
+      [OP_SUBTRACT_NUM] = &&do_OP_SUBTRACT_NUM,
+      [OP_MULTIPLY_NUM] = &&do_OP_MULTIPLY_NUM,
+      [OP_DIVIDE_NUM] = &&do_OP_DIVIDE_NUM,
+      [OP_GREATER_NUM] = &&do_OP_GREATER_NUM,
+      [OP_LESS_NUM] = &&do_OP_LESS_NUM,
+      [OP_ADD_LOCALS] = &&do_OP_ADD_LOCALS,
+      [OP_ADD_LOCAL_CONSTANT] = &&do_OP_ADD_LOCAL_CONSTANT,
+      [OP_SUBTRACT_LOCAL_CONSTANT] = &&do_OP_SUBTRACT_LOCAL_CONSTANT,
+      [OP_SET_LOCAL_POP] = &&do_OP_SET_LOCAL_POP,
+      [OP_LESS_LOCAL_CONSTANT_JUMP] = &&do_OP_LESS_LOCAL_CONSTANT_JUMP,
+  };
+
+#define CASE(name) do_##name
+#define DISPATCH()                    \
+  do {                                \
+    TRACE_INSTRUCTION();              \
+    PROFILE_INSTRUCTION();            \
+    goto *dispatchTable[READ_BYTE()]; \
+  } while (false)
+#else
+#define CASE(name) case name
+#define DISPATCH() break
 #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT:
+
+  for (;;) {
+#ifdef COMPUTED_GOTO
+    DISPATCH();  // never comes back here, handlers dispatch on their own
+    {
+#else
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
+    switch (READ_BYTE()) {
+#endif
+      CASE(OP_CONSTANT): {
         Value constant = READ_CONSTANT_LONG();
         push(constant);
-        break;
-      case OP_NIL:
+        DISPATCH();
+      }
+      CASE(OP_CONSTANT_SHORT): {
+        push(constants[READ_BYTE()]);
+        DISPATCH();
+      }
+      CASE(OP_NIL): {
         push(NIL_VAL);
-        break;
-      case OP_TRUE:
+        DISPATCH();
+      }
+      CASE(OP_TRUE): {
         push(BOOL_VAL(true));
-        break;
-      case OP_FALSE:
+        DISPATCH();
+      }
+      CASE(OP_FALSE): {
         push(BOOL_VAL(false));
-        break;
-      case OP_RETURN: {
+        DISPATCH();
+      }
+      CASE(OP_RETURN): {
         Value result = pop();
-        closeUpvalues(frame->slots);
+        closeUpvalues(slots);
         vm.frameCount--;
         if (vm.frameCount == 0) {
           pop();
           return INTERPRET_OK;
         }
-        vm.stackTop = frame->slots;
+        vm.stackTop = slots;
         push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        DISPATCH();
       }
-      case OP_ADD: {
+      CASE(OP_ADD): {
         if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+          QUICKEN(OP_ADD_STR);
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+          QUICKEN(OP_ADD_NUM);
           double b = AS_NUM(pop());
           double a = AS_NUM(pop());
           push(NUM_VAL(a + b));
         } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
         }
-        break;
+        DISPATCH();
       }
-      case OP_SUBTRACT:
-        BINARY_OP(NUM_VAL, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(NUM_VAL, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(NUM_VAL, /);
-        break;
-      case OP_POWER: {
+      CASE(OP_SUBTRACT): {
+        BINARY_OP(NUM_VAL, -, OP_SUBTRACT_NUM);
+        DISPATCH();
+      }
+      CASE(OP_MULTIPLY): {
+        BINARY_OP(NUM_VAL, *, OP_MULTIPLY_NUM);
+        DISPATCH();
+      }
+      CASE(OP_DIVIDE): {
+        BINARY_OP(NUM_VAL, /, OP_DIVIDE_NUM);
+        DISPATCH();
+      }
+      CASE(OP_POWER): {
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-          runtimeError("Operands must be numbers");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operands must be numbers");
         }
         double b = AS_NUM(pop());
         double a = AS_NUM(pop());
-        push(NUM_VAL(pow(a, b)));
-        break;
+        // squaring is common enough to skip pow() for it
+        push(NUM_VAL(b == 2 ? a * a : pow(a, b)));
+        DISPATCH();
       }
-      case OP_EQUAL:
+      CASE(OP_EQUAL): {
         Value a = pop();
         Value b = pop();
         push(BOOL_VAL(valuesEqual(a, b)));
-        break;
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_NOT:
+        DISPATCH();
+      }
+      CASE(OP_GREATER): {
+        BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+        DISPATCH();
+      }
+      CASE(OP_LESS): {
+        BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+        DISPATCH();
+      }
+      CASE(OP_NOT_EQUAL): {
+        Value a = pop();
+        Value b = pop();
+        push(BOOL_VAL(!valuesEqual(a, b)));
+        DISPATCH();
+      }
+      CASE(OP_GREATER_EQUAL): {
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          RUNTIME_ERROR("Operands must be numbers");
+        }
+        double b = AS_NUM(pop());
+        double a = AS_NUM(pop());
+        // !(a < b) like LESS NOT it replaces, so NaN compares the same way
+        push(BOOL_VAL(!(a < b)));
+        DISPATCH();
+      }
+      CASE(OP_LESS_EQUAL): {
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          RUNTIME_ERROR("Operands must be numbers");
+        }
+        double b = AS_NUM(pop());
+        double a = AS_NUM(pop());
+        push(BOOL_VAL(!(a > b)));
+        DISPATCH();
+      }
+      CASE(OP_NOT): {
         push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE: {
+        DISPATCH();
+      }
+      CASE(OP_NEGATE): {
         if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operand must be a number");
         }
 
         push(NUM_VAL(-AS_NUM(pop())));
 
-        break;
+        DISPATCH();
       }
-      case OP_POP:
-        pop();
-        break;
-      case OP_DEFINE_GLOBAL: {
-        ObjString *name = READ_STRING_LONG();
-        tableSet(&vm.globals, name, peek(0));
+      CASE(OP_POP): {
         pop();
-        break;
+        DISPATCH();
       }
-      case OP_GET_GLOBAL: {
-        ObjString *name = READ_STRING_LONG();
-        Value val;
-        if (!tableGet(&vm.globals, name, &val)) {
-          undefinedVarError(name);
+      CASE(OP_DEFINE_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        vm.globalValues.values[slot] = pop();
+        DISPATCH();
+      }
+      CASE(OP_GET_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        Value val = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(val)) {
+          STORE_FRAME();
+          undefinedVarError(AS_STRING(vm.globalNames.values[slot]));
           return INTERPRET_RUNTIME_ERROR;
         }
 
         push(val);
-        break;
+        DISPATCH();
       }
-      case OP_SET_GLOBAL: {
-        ObjString *name = READ_STRING_LONG();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name);
-          undefinedVarError(name);
+      CASE(OP_SET_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          STORE_FRAME();
+          undefinedVarError(AS_STRING(vm.globalNames.values[slot]));
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        break;
+        vm.globalValues.values[slot] = peek(0);
+        DISPATCH();
       }
-      case OP_GET_LOCAL: {
+      CASE(OP_GET_GLOBAL_SHORT): {
+        uint8_t slot = READ_BYTE();
+        Value val = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(val)) {
+          STORE_FRAME();
+          undefinedVarError(AS_STRING(vm.globalNames.values[slot]));
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        push(val);
+        DISPATCH();
+      }
+      CASE(OP_SET_GLOBAL_SHORT): {
+        uint8_t slot = READ_BYTE();
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          STORE_FRAME();
+          undefinedVarError(AS_STRING(vm.globalNames.values[slot]));
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        vm.globalValues.values[slot] = peek(0);
+        DISPATCH();
+      }
+      CASE(OP_GET_LOCAL): {
         uint16_t slot = READ_SHORT();
-        push(frame->slots[slot]);
-        break;
+        push(slots[slot]);
+        DISPATCH();
       }
-      case OP_SET_LOCAL: {
+      CASE(OP_SET_LOCAL): {
         uint16_t slot = READ_SHORT();
-        frame->slots[slot] = peek(0);
-        break;
+        slots[slot] = peek(0);
+        DISPATCH();
       }
-      case OP_JUMP_FALSE: {
+      CASE(OP_GET_LOCAL_SHORT): {
+        push(slots[READ_BYTE()]);
+        DISPATCH();
+      }
+      CASE(OP_SET_LOCAL_SHORT): {
+        slots[READ_BYTE()] = peek(0);
+        DISPATCH();
+      }
+      CASE(OP_JUMP_FALSE): {
         uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;
+        if (isFalsey(peek(0))) ip += offset;
+        DISPATCH();
       }
-      case OP_JUMP: {
+      CASE(OP_POP_JUMP_IF_FALSE): {
         uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+        if (isFalsey(pop())) ip += offset;
+        DISPATCH();
       }
-      case OP_LOOP: {
+      CASE(OP_JUMP): {
         uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+        ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_LOOP): {
+        uint16_t offset = READ_SHORT();
+        SAFE_POINT();
+        ip -= offset;
+        DISPATCH();
+      }
+      CASE(OP_LOOP_LT): {
+        Value counter = slots[READ_BYTE()];
+        Value limit = slots[READ_BYTE()];
+        uint16_t offset = READ_SHORT();
+        if (!IS_NUMBER(counter) || !IS_NUMBER(limit)) {
+          RUNTIME_ERROR("Operands must be numbers");
+        }
+        if (!(AS_NUM(counter) < AS_NUM(limit))) ip += offset;
+        DISPATCH();
       }
-      case OP_CALL: {
+      CASE(OP_FOR_NUM_STEP): {
+        // same checks in same order as `i = i + step` and `i < limit`
+        Value *counter = &slots[READ_BYTE()];
+        uint8_t limitSlot = READ_BYTE();
+        double step = AS_NUM(READ_CONSTANT_LONG());
+        uint16_t offset = READ_SHORT();
+        if (!IS_NUMBER(*counter)) {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        double next = AS_NUM(*counter) + step;
+        *counter = NUM_VAL(next);
+
+        Value limit = slots[limitSlot];  // limit can be the counter itself
+        if (!IS_NUMBER(limit)) {
+          ip -= 4;  // error is reported at limit byte (line of condition)
+          RUNTIME_ERROR("Operands must be numbers");
+        }
+        if (next < AS_NUM(limit)) {
+          SAFE_POINT();
+          ip -= offset;
+        }
+        DISPATCH();
+      }
+      CASE(OP_CALL): {
         int argCount = READ_BYTE();
+        STORE_FRAME();
         if (!callValue(peek(argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(OP_TAIL_CALL): {
+        int argCount = READ_BYTE();
+        // reused frame skips call(), tail recursion is a loop too
+        SAFE_POINT();
+        Value callee = peek(argCount);
+
+        ObjClosure *closure = NULL;
+        if (IS_CLOSURE(callee)) {
+          closure = AS_CLOSURE(callee);
+        } else if (IS_BOUND_METHOD(callee)) {
+          ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+          vm.stackTop[-argCount - 1] = bound->receiver;
+          closure = bound->method;
+        }
+
+        // natives and classes are called normally, OP_RETURN after this
+        // returns their result
+        if (closure == NULL) {
+          STORE_FRAME();
+          if (!callValue(callee, argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          LOAD_FRAME();
+          DISPATCH();
+        }
+
+        if (argCount != closure->function->arity) {
+          RUNTIME_ERROR("Expected %d arguments but got %d",
+                        closure->function->arity, argCount);
+        }
+
+        // callee and arguments slide down over the current frame
+        closeUpvalues(slots);
+        if (!ensureStack(slots, closure->function)) {
+          RUNTIME_ERROR("Stack overflow");
+        }
+        slots = frame->slots;  // stack may have moved
+        memmove(slots, vm.stackTop - argCount - 1,
+                sizeof(Value) * (argCount + 1));
+        vm.stackTop = slots + argCount + 1;
+
+        frame->closure = closure;
+        frame->ip = closure->function->chunk.code;
+        LOAD_FRAME();
+        DISPATCH();
       }
-      case OP_CLOSURE: {
+      CASE(OP_CLOSURE): {
         ObjFunc *function = AS_FUNCTION(READ_CONSTANT_LONG());
         ObjClosure *closure = newClosure(function);
         push(OBJ_VAL(closure));
         for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
+          uint8_t capture = READ_BYTE();
           uint16_t index = READ_SHORT();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+          if (capture == CAPTURE_LOCAL) {
+            closure->upvalues[i] = OBJ_VAL(captureUpvalue(slots + index));
+          } else if (capture == CAPTURE_VALUE) {
+            closure->upvalues[i] = slots[index];
           } else {
             closure->upvalues[i] = frame->closure->upvalues[index];
           }
+          // capturing can allocate, closure may be old already
+          writeBarrier((Obj *)closure, closure->upvalues[i]);
         }
-        break;
+        DISPATCH();
       }
-      case OP_GET_UPVALUE: {
+      CASE(OP_GET_UPVALUE): {
         uint16_t slot = READ_SHORT();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
+        push(*AS_UPVALUE(frame->closure->upvalues[slot])->location);
+        DISPATCH();
       }
-      case OP_SET_UPVALUE: {
-        uint16_t slot = READ_SHORT();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+      CASE(OP_SET_UPVALUE): {
+        ObjUpvalue *upvalue = AS_UPVALUE(frame->closure->upvalues[READ_SHORT()]);
+        *upvalue->location = peek(0);
+        writeBarrier((Obj *)upvalue, peek(0));
+        DISPATCH();
+      }
+      CASE(OP_GET_UPVALUE_SHORT): {
+        push(*AS_UPVALUE(frame->closure->upvalues[READ_BYTE()])->location);
+        DISPATCH();
+      }
+      CASE(OP_SET_UPVALUE_SHORT): {
+        ObjUpvalue *upvalue = AS_UPVALUE(frame->closure->upvalues[READ_BYTE()]);
+        *upvalue->location = peek(0);
+        writeBarrier((Obj *)upvalue, peek(0));
+        DISPATCH();
       }
-      case OP_CLOSE_UPVALUE: {
+      CASE(OP_GET_CAPTURED): {
+        push(frame->closure->upvalues[READ_SHORT()]);
+        DISPATCH();
+      }
+      CASE(OP_GET_CAPTURED_SHORT): {
+        push(frame->closure->upvalues[READ_BYTE()]);
+        DISPATCH();
+      }
+      CASE(OP_CLOSE_UPVALUE): {
         closeUpvalues(vm.stackTop - 1);
         pop();
-        break;
+        DISPATCH();
       }
-      case OP_CLASS:
+      CASE(OP_CLASS): {
         push(OBJ_VAL(newClass(READ_STRING_LONG())));
-        break;
-      case OP_GET_PROPERTY: {
+        DISPATCH();
+      }
+      CASE(OP_GET_PROPERTY): {
         if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances can have properties");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Only instances can have properties");
         }
 
-        ObjInstance *instance = AS_INSTANCE(peek(0));
         ObjString *name = READ_STRING_LONG();
-        Value val;
-
-        if (tableGet(&instance->fields, name, &val)) {
-          pop();  // pop instance
-          push(val);
-          break;
-        }
-
-        if (!bindMethod(instance->cclass, name)) {
+        InlineCache *cache = READ_CACHE();
+        STORE_FRAME();
+        if (!getProperty(name, cache)) {
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        break;
+        DISPATCH();
       }
-      case OP_SET_PROPERTY: {
+      CASE(OP_SET_PROPERTY): {
         if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances can have fields");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Only instances can have fields");
         }
 
-        ObjInstance *instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING_LONG(), peek(0));
+        ObjString *name = READ_STRING_LONG();
+        setProperty(name, READ_CACHE());
 
         Value val = pop();
         pop();
         push(val);
-        break;
+        DISPATCH();
       }
-      case OP_METHOD:
+      CASE(OP_METHOD): {
         defineMethod(READ_STRING_LONG());
-        break;
-      case OP_INVOKE: {
+        DISPATCH();
+      }
+      CASE(OP_INVOKE): {
         ObjString *method = READ_STRING_LONG();
         int argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
+        InlineCache *cache = READ_CACHE();
+        STORE_FRAME();
+        if (!invoke(method, argCount, cache)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        DISPATCH();
       }
-      case OP_INHERIT: {
+      CASE(OP_ADD_NUM): {
+        BINARY_OP_NUM(NUM_VAL, +, OP_ADD);
+        DISPATCH();
+      }
+      CASE(OP_ADD_STR): {
+        if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+          DEOPTIMIZE(OP_ADD);
+          DISPATCH();
+        }
+        concatenate();
+        DISPATCH();
+      }
+      CASE(OP_SUBTRACT_NUM): {
+        BINARY_OP_NUM(NUM_VAL, -, OP_SUBTRACT);
+        DISPATCH();
+      }
+      CASE(OP_MULTIPLY_NUM): {
+        BINARY_OP_NUM(NUM_VAL, *, OP_MULTIPLY);
+        DISPATCH();
+      }
+      CASE(OP_DIVIDE_NUM): {
+        BINARY_OP_NUM(NUM_VAL, /, OP_DIVIDE);
+        DISPATCH();
+      }
+      CASE(OP_GREATER_NUM): {
+        BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER);
+        DISPATCH();
+      }
+      CASE(OP_LESS_NUM): {
+        BINARY_OP_NUM(BOOL_VAL, <, OP_LESS);
+        DISPATCH();
+      }
+      CASE(OP_ADD_LOCALS): {
+        Value a = slots[READ_BYTE()];
+        Value b = slots[READ_BYTE()];
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          push(NUM_VAL(AS_NUM(a) + AS_NUM(b)));
+        } else if (IS_STRING(a) && IS_STRING(b)) {
+          push(a);
+          push(b);
+          concatenate();
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        DISPATCH();
+      }
+      CASE(OP_ADD_LOCAL_CONSTANT): {
+        // optimizer only fuses number constants
+        Value a = slots[READ_BYTE()];
+        Value b = constants[READ_BYTE()];
+        if (!IS_NUMBER(a)) {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        push(NUM_VAL(AS_NUM(a) + AS_NUM(b)));
+        DISPATCH();
+      }
+      CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+        Value a = slots[READ_BYTE()];
+        Value b = constants[READ_BYTE()];
+        if (!IS_NUMBER(a)) RUNTIME_ERROR("Operands must be numbers");
+        push(NUM_VAL(AS_NUM(a) - AS_NUM(b)));
+        DISPATCH();
+      }
+      CASE(OP_SET_LOCAL_POP): {
+        slots[READ_BYTE()] = pop();
+        DISPATCH();
+      }
+      CASE(OP_LESS_LOCAL_CONSTANT_JUMP): {
+        Value a = slots[READ_BYTE()];
+        Value b = constants[READ_BYTE()];
+        uint16_t offset = READ_SHORT();
+        if (!IS_NUMBER(a)) RUNTIME_ERROR("Operands must be numbers");
+        if (!(AS_NUM(a) < AS_NUM(b))) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_INHERIT): {
         Value superclass = peek(1);
         if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Superclass must be a class");
         }
         ObjClass *subclass = AS_CLASS(peek(0));
         tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+        rememberObject((Obj *)subclass);
+        subclass->version++;
         pop();  // subclass
-        break;
+        DISPATCH();
       }
-      case OP_GET_SUPER: {
+      CASE(OP_GET_SUPER): {
         ObjString *name = READ_STRING_LONG();
         ObjClass *superclass = AS_CLASS(pop());
+        STORE_FRAME();
         if (!bindMethod(superclass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        break;
+        DISPATCH();
       }
-      case OP_SUPER_INVOKE: {
+      CASE(OP_SUPER_INVOKE): {
         ObjString *method = READ_STRING_LONG();
         int argCount = READ_BYTE();
+        InlineCache *cache = READ_CACHE();
         ObjClass *superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
+        STORE_FRAME();
+        if (!superInvoke(superclass, method, argCount, cache)) {
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        DISPATCH();
       }
     }
   }
@@ -602,18 +1433,31 @@ static InterpretResult run() {
 #undef READ_SHORT
 #undef READ_CONSTANT_LONG
 #undef READ_STRING_LONG
+#undef READ_CACHE
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef BINARY_OP_NUM
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char *source) {
   ObjFunc *func = compile(source);
   if (func == NULL) return INTERPRET_COMPILE_ERROR;
+  // memory used by compiling isn't script's error, it can free some first
+  vm.outOfMemory = false;
 
   push(OBJ_VAL(func));
   ObjClosure *closure = newClosure(func);
   pop();
   push(OBJ_VAL(closure));
-  callValue(OBJ_VAL(closure), 0);
+  if (!callValue(OBJ_VAL(closure), 0)) return INTERPRET_RUNTIME_ERROR;
 
   return run();
 }
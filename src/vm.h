@@ -12,9 +12,26 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
-// Stack overflow handling only for frames
+// value stack and frames start small and grow (doubling) up to these hard
+// limits, going past them is "Stack overflow". define them at build time
+// to change the limits
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 65536
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (1 << 22)
+#endif
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
+
+// call makes sure the whole frame fits (function->maxStack), so pushes
+// never check. slack is for values vm pushes on its own inside an op
+// (GC roots, concatenation of locals...)
+#define STACK_SLACK 8
+
+// bound methods made by property reads are reused while the same receiver
+// and method come again (see bindCached), power of 2
+#define BOUND_CACHE_SIZE 64
 
 typedef struct {
   ObjClosure *closure;
@@ -22,6 +39,41 @@ typedef struct {
   Value *slots;
 } CallFrame;
 
+// phases of incremental full collection (see gcStep), minor collections
+// only run while collector is idle
+typedef enum {
+  GC_IDLE,
+  GC_PREPARE,  // unmarking old objects
+  GC_MARK,     // tracing gray objects
+  GC_SWEEP,    // freeing objects that stayed white
+} GCPhase;
+
+// pause i counts GC pauses shorter than 2^i microseconds, last one counts
+// everything longer
+#define GC_PAUSE_BUCKETS 16
+
+// counters of collector, always kept (see gcStats() native and --gc-stats)
+typedef struct {
+  int cycles;  // full collections
+  int minorCollections;
+
+  // pause times of all collections and steps, in seconds
+  int pauses[GC_PAUSE_BUCKETS];
+  double totalPause;
+  double maxPause;
+
+  size_t totalAllocated;
+  size_t totalFreed;      // by collections
+  size_t lastFreed;       // by last full cycle
+  double allocationRate;  // bytes per second between last two collections
+
+  // where running cycle started and last collection ended
+  size_t cycleStartBytes;
+  size_t cycleStartAllocated;
+  double lastEnd;
+  size_t lastEndAllocated;
+} GCStats;
+
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
@@ -29,29 +81,71 @@ typedef enum {
 } InterpretResult;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];  // frames
-  int frameCount;                // count of frames
+  CallFrame *frames;  // frames
+  int frameCount;     // count of frames
+  int frameCapacity;
 
-  Value stack[STACK_MAX];  // stack
-  Value *stackTop;         // pointer to stack top
+  // growing moves the stack, CallFrame.slots, open upvalues and
+  // stackTop are relocated (run() reloads its cached slots after calls)
+  Value *stack;     // stack
+  Value *stackTop;  // pointer to stack top
+  int stackCapacity;
 
   Table strings;  // table of strings (for optimization)
-  Table globals;  // table of globals
+
+  // globals are resolved to slots by the compiler, slot stays
+  // UNDEFINED_VAL until the global is defined
+  Table globalSlots;         // name -> slot index
+  ValueArray globalValues;   // values of globals
+  ValueArray globalNames;    // names of globals (for errors)
 
   ObjString *initString;  // init method name
 
-  ObjUpvalue *openUpvalues;  // all open upvalues
+  // open upvalues are listed from the highest stack slot down (closing
+  // pops them from the head), and indexed by their slot for capturing
+  ObjUpvalue *openUpvalues;
+  ObjUpvalue **openUpvalueSlots;  // stackCapacity items, NULL when not open
+
+  // weak, every collection clears it before sweeping
+  ObjBoundMethod *boundMethods[BOUND_CACHE_SIZE];
 
   // variables to now when call GC
   size_t bytesAllocated;
-  size_t nextGC;
-
-  Obj *objects;  // objects
+  size_t nextGC;      // full collection when bytesAllocated gets here
+  size_t youngBytes;  // allocated since last collection (for minor one)
+
+  // pacer: next cycle starts when heap grows gcGrowth times over what
+  // survived (gcMinHeap at least), nearing gcSoftLimit it grows less and
+  // over gcHardLimit (after full collection) run() raises runtime error
+  double gcGrowth;
+  size_t gcMinHeap;
+  size_t gcSoftLimit;  // 0 is no limit
+  size_t gcHardLimit;  // 0 is no limit
+  bool outOfMemory;    // over gcHardLimit, error at next safe point
+
+  // objects are young until they survive a collection, then they stay
+  // marked (see collectYoung), objects live in heap segments (heap.h)
+
+  // old objects that got references to young ones since last collection
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **remembered;
 
   // for GC
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
+
+  // incremental full collection
+  GCPhase gcPhase;
+  int gcCursor;       // next segment to unmark or sweep
+  size_t nextStep;    // next incremental step when bytesAllocated gets here
+  double gcMaxPause;  // time budget of one step in seconds
+  int gcThreads;      // threads of stop-the-world marking and sweeping
+  bool gcCompact;     // compact fragmented heap (see compact.h)
+  bool compactPending;
+
+  GCStats gcStats;
 } VM;
 
 extern VM vm;
@@ -61,6 +155,9 @@ void freeVM();
 
 InterpretResult interpret(const char *source);
 
+// slot of global variable name, new slot is created when needed
+int globalSlot(ObjString *name);
+
 void push(Value value);
 Value pop();
 